@@ -0,0 +1,155 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <math.h>
+#include "main.h"
+#include "scene.h"
+
+using namespace std;
+
+/**
+ * Benchmark of the acceleration structures on generated scenes. Every scene is traced
+ * with primary rays through the image plane, the way the renderer shoots them, and all
+ * structures must agree on the closest hits.
+ *
+ *   dense     similar spheres packed uniformly in front of the camera, where a grid's
+ *             linear build and cheap cell walk win
+ *   stadium   a tight cluster plus a few spheres spread far apart ("teapot in a
+ *             stadium"): the cluster lands in a handful of cells of a single grid, a
+ *             two-level grid recovers part of that, the BVH adapts to it outright
+ *   mixed     small spheres around a few huge ones, which overlap thousands of cells
+ *             each; the grids hold up as long as such spheres stay rare
+ *
+ * Usage: ./bench_accel [spheres per scene, 100000 by default]
+ */
+#define BENCH_RAYS_PER_SIDE 128
+
+struct bench_scene_t {
+  string name;
+  vector<sphere_t> spheres;
+};
+
+double random_in(mt19937 *generator, double low, double high) {
+  return uniform_real_distribution<double>(low, high)(*generator);
+}
+
+sphere_t bench_sphere(mt19937 *generator, position_t low, position_t high, int radius) {
+  return sphere_t {
+    color_t { 255, 255, 255, AMBIENT_LIGHT },
+    position_t { random_in(generator, low.x, high.x), random_in(generator, low.y, high.y), random_in(generator, low.z, high.z) },
+    radius
+  };
+}
+
+vector<bench_scene_t> bench_scenes(int count) {
+  mt19937 generator(460);
+  vector<bench_scene_t> scenes;
+
+  bench_scene_t dense = bench_scene_t { "dense" };
+  for(int i = 0; i < count; i++) {
+    dense.spheres.push_back(bench_sphere(&generator, position_t { -400, -400, 200 }, position_t { 400, 400, 1000 }, 2 + i % 3));
+  }
+  scenes.push_back(dense);
+
+  bench_scene_t stadium = bench_scene_t { "stadium" };
+  for(int i = 0; i < count; i++) {
+    if(i % 100 == 0) {
+      stadium.spheres.push_back(bench_sphere(&generator, position_t { -20000, -20000, 200 }, position_t { 20000, 20000, 40000 }, 5));
+    } else {
+      stadium.spheres.push_back(bench_sphere(&generator, position_t { -40, -40, 500 }, position_t { 40, 40, 580 }, 1));
+    }
+  }
+  scenes.push_back(stadium);
+
+  bench_scene_t mixed = bench_scene_t { "mixed" };
+  for(int i = 0; i < count; i++) {
+    int radius = i % 1000 == 0 ? 150 : 2;
+    mixed.spheres.push_back(bench_sphere(&generator, position_t { -500, -500, 300 }, position_t { 500, 500, 1300 }, radius));
+  }
+  scenes.push_back(mixed);
+  return scenes;
+}
+
+/**
+ * Distance along the ray to the nearest point of the sphere in front of the origin, or
+ * INFINITY.
+ */
+double sphere_hit(vector_t ray_vec, sphere_t sphere) {
+  position_t d = ray_vec.direction.approximate();
+  position_t oc = ray_vec.origin - sphere.center;
+  double a = dot(d, d), b = 2 * dot(d, oc), c = dot(oc, oc) - (double) sphere.radius * sphere.radius;
+  double discr = b * b - 4 * a * c;
+  if(discr < 0) return INFINITY;
+  double t1 = (-b - sqrt(discr)) / (2 * a), t2 = (-b + sqrt(discr)) / (2 * a);
+  return t1 >= 0 ? t1 : (t2 >= 0 ? t2 : INFINITY);
+}
+
+struct bench_result_t {
+  double build_ms;
+  double trace_ms;
+  double tests_per_ray;
+  double checksum;
+};
+
+bench_result_t run_bench(const bench_scene_t &scene, acceleration_t acceleration) {
+  input_data_t input_data = input_data_t { scene.spheres };
+  input_data.acceleration = acceleration;
+
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  if(acceleration == ACCELERATION_BVH) {
+    input_data.bvh = build_bvh(input_data.spheres);
+  } else {
+    input_data.grid = build_grid(input_data.spheres, acceleration == ACCELERATION_TWO_LEVEL_GRID);
+  }
+  chrono::steady_clock::time_point built = chrono::steady_clock::now();
+
+  long long tests = 0;
+  double checksum = 0;
+  for(int x = 0; x < BENCH_RAYS_PER_SIDE; x++) {
+    for(int y = 0; y < BENCH_RAYS_PER_SIDE; y++) {
+      vector_t ray_vec = vector_t { origin, direction_t {
+        PLANE_START_X + (x + 0.5) * PLANE_WIDTH / BENCH_RAYS_PER_SIDE,
+        PLANE_START_Y + (y + 0.5) * PLANE_HEIGHT / BENCH_RAYS_PER_SIDE,
+        PLANE_Z
+      } };
+      double closest = INFINITY;
+      traverse_scene(input_data, ray_vec, [&](int i) {
+        tests++;
+        closest = min(closest, sphere_hit(ray_vec, input_data.spheres[i]));
+      });
+      if(closest < INFINITY) checksum += closest;
+    }
+  }
+  chrono::steady_clock::time_point traced = chrono::steady_clock::now();
+  return bench_result_t {
+    chrono::duration<double, milli>(built - start).count(),
+    chrono::duration<double, milli>(traced - built).count(),
+    (double) tests / (BENCH_RAYS_PER_SIDE * BENCH_RAYS_PER_SIDE),
+    checksum
+  };
+}
+
+int main(int argc, char **argv) {
+  int count = argc > 1 ? atoi(argv[1]) : 100000;
+  acceleration_t accelerations[3] = { ACCELERATION_BVH, ACCELERATION_GRID, ACCELERATION_TWO_LEVEL_GRID };
+  string names[3] = { "bvh", "grid", "grid2" };
+
+  cout << count << " spheres per scene, " << BENCH_RAYS_PER_SIDE << "x" << BENCH_RAYS_PER_SIDE << " primary rays" << endl;
+  cout << left << setw(10) << "scene" << setw(8) << "accel" << right << setw(12) << "build ms"
+       << setw(12) << "trace ms" << setw(14) << "tests/ray" << endl;
+  for(const bench_scene_t & scene : bench_scenes(count)) {
+    double reference = 0;
+    for(int a = 0; a < 3; a++) {
+      bench_result_t result = run_bench(scene, accelerations[a]);
+      if(a == 0) reference = result.checksum;
+      cout << left << setw(10) << scene.name << setw(8) << names[a] << right << fixed << setprecision(1)
+           << setw(12) << result.build_ms << setw(12) << result.trace_ms << setw(14) << result.tests_per_ray;
+      if(result.checksum != reference) cout << "  (closest hits differ from bvh)";
+      cout << endl;
+    }
+  }
+  return 0;
+}
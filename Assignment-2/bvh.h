@@ -0,0 +1,490 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include <atomic>
+#include "main.h"
+#include "thread_pool.h"
+
+/**
+ * Ranges of at most BVH_LEAF_SIZE spheres always become leaves. Up to BVH_MAX_LEAF_SIZE
+ * they become leaves when the surface area heuristic finds no split worth its cost.
+ */
+#define BVH_LEAF_SIZE 4
+#define BVH_MAX_LEAF_SIZE 16
+
+/**
+ * Number of bins per axis the SAH builder sorts sphere centers into.
+ */
+#define BVH_BINS 16
+
+/**
+ * Below this depth nodes are split by the SAH; deeper ones are split at the median to
+ * keep the traversal stack bounded.
+ */
+#define BVH_MAX_DEPTH 48
+#define BVH_STACK_SIZE 128
+
+/**
+ * Subtrees with more spheres than this are built as separate tasks on the thread pool,
+ * and ranges with more spheres than BVH_PARALLEL_BINNING are binned in parallel.
+ */
+#define BVH_PARALLEL_THRESHOLD 4096
+#define BVH_PARALLEL_BINNING 65536
+
+/**
+ * Boxes are grown by this much on every side, so rounding in the intersection test
+ * cannot report a hit outside the box.
+ */
+#define BVH_PADDING 0.01
+
+/**
+ * Relative costs of visiting a node and of intersecting a sphere, used by the surface
+ * area heuristic.
+ */
+#define BVH_TRAVERSAL_COST 1.0
+#define BVH_INTERSECTION_COST 1.0
+
+/**
+ * A refitted tree is rebuilt once its SAH cost exceeds the cost it had when it was
+ * built by this factor.
+ */
+#define BVH_REBUILD_RATIO 1.5
+
+/**
+ * Axis aligned bounding box.
+ */
+struct aabb_t {
+  position_t low;
+  position_t high;
+
+  /**
+   * Written with plain comparisons so the compiler emits min/max instructions instead
+   * of branches, which mispredict constantly on unsorted input.
+   */
+  void extend(const aabb_t &other) {
+    this->low.x = other.low.x < this->low.x ? other.low.x : this->low.x;
+    this->low.y = other.low.y < this->low.y ? other.low.y : this->low.y;
+    this->low.z = other.low.z < this->low.z ? other.low.z : this->low.z;
+    this->high.x = other.high.x > this->high.x ? other.high.x : this->high.x;
+    this->high.y = other.high.y > this->high.y ? other.high.y : this->high.y;
+    this->high.z = other.high.z > this->high.z ? other.high.z : this->high.z;
+  }
+  double surface_area() const {
+    double dx = this->high.x - this->low.x, dy = this->high.y - this->low.y, dz = this->high.z - this->low.z;
+    if(dx < 0 || dy < 0 || dz < 0) return 0;
+    return 2 * (dx * dy + dy * dz + dz * dx);
+  }
+  /**
+   * Slab test against the ray origin + t * direction for t >= 0.
+   */
+  bool hit(position_t ray_origin, position_t inverse_direction) const {
+    double t_near = 0, t_far = INFINITY;
+    return this->clip(ray_origin, inverse_direction, &t_near, &t_far);
+  }
+  /**
+   * Narrows [*t_near, *t_far] down to the part of the ray inside the box. Returns false
+   * if nothing of it is left.
+   */
+  bool clip(position_t ray_origin, position_t inverse_direction, double *t_near, double *t_far) const {
+    double low[3] = { this->low.x, this->low.y, this->low.z };
+    double high[3] = { this->high.x, this->high.y, this->high.z };
+    double o[3] = { ray_origin.x, ray_origin.y, ray_origin.z };
+    double inv[3] = { inverse_direction.x, inverse_direction.y, inverse_direction.z };
+    for(int axis = 0; axis < 3; axis++) {
+      double t1 = (low[axis] - o[axis]) * inv[axis];
+      double t2 = (high[axis] - o[axis]) * inv[axis];
+      if(isnan(t1) || isnan(t2)) continue; // Ray lies on the slab boundary
+      *t_near = max(*t_near, min(t1, t2));
+      *t_far = min(*t_far, max(t1, t2));
+    }
+    return *t_near <= *t_far;
+  }
+};
+
+aabb_t empty_aabb() {
+  return aabb_t { position_t { INFINITY, INFINITY, INFINITY }, position_t { -INFINITY, -INFINITY, -INFINITY } };
+}
+
+aabb_t sphere_bounds(sphere_t sphere) {
+  double r = sphere.radius + BVH_PADDING;
+  position_t center = sphere.center;
+  return aabb_t { center - position_t { r, r, r }, center + position_t { r, r, r } };
+}
+
+/**
+ * A node is a leaf over indices[first, first + count) when count is positive; interior
+ * nodes have count 0 and their two children at nodes[first] and nodes[first + 1].
+ * Children always come after their parent, so walking the array backwards visits
+ * every node after its children.
+ */
+struct bvh_node_t {
+  aabb_t bounds;
+  int first;
+  int count;
+};
+
+/**
+ * Bounding volume hierarchy over a list of primitives, the scene's spheres or the
+ * triangles of a mesh. `indices` holds primitive indexes in leaf order, so a sphere
+ * keeps its index in the list (and its primitive id).
+ */
+struct bvh_t {
+  vector<bvh_node_t> nodes;
+  vector<int> indices;
+  double built_cost;
+};
+
+/**
+ * Refits the bounds of every node from the current spheres without changing the tree
+ * shape. One pass over the nodes, children first.
+ */
+void refit_bvh(bvh_t *bvh, const vector<sphere_t> &spheres) {
+  for(int i = (int) bvh->nodes.size() - 1; i >= 0; i--) {
+    bvh_node_t &node = bvh->nodes[i];
+    node.bounds = empty_aabb();
+    if(node.count > 0) {
+      for(int j = node.first; j < node.first + node.count; j++) {
+        node.bounds.extend(sphere_bounds(spheres[bvh->indices[j]]));
+      }
+    } else {
+      node.bounds.extend(bvh->nodes[node.first].bounds);
+      node.bounds.extend(bvh->nodes[node.first + 1].bounds);
+    }
+  }
+}
+
+/**
+ * Expected cost of tracing a random ray through the tree, by the surface area
+ * heuristic. Used as the quality metric of the tree.
+ */
+double sah_cost(const bvh_t &bvh) {
+  if(bvh.nodes.empty()) return 0;
+  double root_area = bvh.nodes[0].bounds.surface_area();
+  if(root_area == 0) return 0;
+  double cost = 0;
+  for(const bvh_node_t & node : bvh.nodes) {
+    double probability = node.bounds.surface_area() / root_area;
+    cost += node.count > 0
+      ? probability * node.count * BVH_INTERSECTION_COST
+      : probability * BVH_TRAVERSAL_COST;
+  }
+  return cost;
+}
+
+/**
+ * What the builder needs to know about a primitive, kept contiguous so that binning and
+ * partitioning stream through memory instead of chasing indexes into the primitive list.
+ */
+struct bvh_ref_t {
+  aabb_t bounds;
+  position_t center;
+  int index;
+};
+
+/**
+ * Shared state of one tree build. Nodes are preallocated and handed out in pairs from
+ * `next_node`, so tasks building different subtrees never touch the same node.
+ */
+struct bvh_builder_t {
+  vector<bvh_ref_t> refs;
+  bvh_t *bvh;
+  atomic<int> next_node;
+  task_group_t group;
+};
+
+/**
+ * Sphere counts and bounds of every bin on every axis.
+ */
+struct sah_bins_t {
+  int count[3][BVH_BINS];
+  aabb_t bounds[3][BVH_BINS];
+
+  void clear() {
+    for(int axis = 0; axis < 3; axis++) {
+      for(int bin = 0; bin < BVH_BINS; bin++) {
+        this->count[axis][bin] = 0;
+        this->bounds[axis][bin] = empty_aabb();
+      }
+    }
+  }
+  void merge(const sah_bins_t &other) {
+    for(int axis = 0; axis < 3; axis++) {
+      for(int bin = 0; bin < BVH_BINS; bin++) {
+        this->count[axis][bin] += other.count[axis][bin];
+        this->bounds[axis][bin].extend(other.bounds[axis][bin]);
+      }
+    }
+  }
+};
+
+double axis_value(position_t point, int axis) {
+  return axis == 0 ? point.x : (axis == 1 ? point.y : point.z);
+}
+
+/**
+ * Bin of a center coordinate, with `scale` being BVH_BINS over the centroid extent.
+ */
+int bin_of(double value, double low, double scale) {
+  return min(BVH_BINS - 1, (int) ((value - low) * scale));
+}
+
+/**
+ * Ranges this large are split into chunks worked on by the whole pool; smaller ones
+ * are handled by the calling thread alone.
+ */
+int builder_chunks(int count) {
+  return count > BVH_PARALLEL_BINNING ? thread_pool().size() * 4 : 1;
+}
+
+void extend_centroids(const vector<bvh_ref_t> &refs, int begin, int end, aabb_t *bounds) {
+  for(int i = begin; i < end; i++) bounds->extend(aabb_t { refs[i].center, refs[i].center });
+}
+
+/**
+ * Bounds of the sphere centers in refs[first, first + count).
+ */
+aabb_t centroid_bounds(bvh_builder_t *builder, int first, int count) {
+  const vector<bvh_ref_t> &refs = builder->refs;
+  aabb_t bounds = empty_aabb();
+  int chunks = builder_chunks(count);
+  if(chunks == 1) {
+    extend_centroids(refs, first, first + count, &bounds);
+    return bounds;
+  }
+  vector<aabb_t> partial(chunks, empty_aabb());
+  parallel_chunks(first, first + count, chunks, [&](int chunk, int begin, int end) {
+    extend_centroids(refs, begin, end, &partial[chunk]);
+  });
+  for(const aabb_t & chunk : partial) bounds.extend(chunk);
+  return bounds;
+}
+
+/**
+ * Adds refs[begin, end) to the bins of all three axes, `low` and `scale` being the
+ * centroid bounds' low corner and BVH_BINS over their extent on every axis.
+ */
+void bin_range(const vector<bvh_ref_t> &refs, int begin, int end, const double *low, const double *scale, sah_bins_t *bins) {
+  for(int i = begin; i < end; i++) {
+    const bvh_ref_t &ref = refs[i];
+    for(int axis = 0; axis < 3; axis++) {
+      if(!isfinite(scale[axis])) continue;
+      int bin = bin_of(axis_value(ref.center, axis), low[axis], scale[axis]);
+      bins->count[axis][bin]++;
+      bins->bounds[axis][bin].extend(ref.bounds);
+    }
+  }
+}
+
+/**
+ * Bins refs[first, first + count) by center on all three axes at once.
+ */
+sah_bins_t bin_spheres(bvh_builder_t *builder, int first, int count, aabb_t centroids) {
+  const vector<bvh_ref_t> &refs = builder->refs;
+  position_t extent = centroids.high - centroids.low;
+  double low[3] = { centroids.low.x, centroids.low.y, centroids.low.z };
+  double scale[3] = { BVH_BINS / extent.x, BVH_BINS / extent.y, BVH_BINS / extent.z };
+  sah_bins_t bins;
+  bins.clear();
+  int chunks = builder_chunks(count);
+  if(chunks == 1) {
+    bin_range(refs, first, first + count, low, scale, &bins);
+    return bins;
+  }
+  vector<sah_bins_t> partial(chunks);
+  parallel_chunks(first, first + count, chunks, [&](int chunk, int begin, int end) {
+    partial[chunk].clear();
+    bin_range(refs, begin, end, low, scale, &partial[chunk]);
+  });
+  for(const sah_bins_t & chunk : partial) bins.merge(chunk);
+  return bins;
+}
+
+/**
+ * Splits refs[first, first + count) at the median of the longest centroid axis and
+ * returns the size of the first half.
+ */
+int median_split(bvh_builder_t *builder, int first, int count, aabb_t centroids) {
+  vector<bvh_ref_t> &refs = builder->refs;
+  position_t extent = centroids.high - centroids.low;
+  int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+  int half = count / 2;
+  nth_element(refs.begin() + first, refs.begin() + first + half, refs.begin() + first + count,
+              [axis](const bvh_ref_t &l, const bvh_ref_t &r) { return axis_value(l.center, axis) < axis_value(r.center, axis); });
+  return half;
+}
+
+/**
+ * Binned surface area heuristic split of refs[first, first + count). Picks the bin
+ * boundary minimizing SA(left) * N(left) + SA(right) * N(right) over all three axes,
+ * makes a leaf when that is no cheaper than intersecting every sphere, and falls back
+ * to a median split when depth runs out or no bin boundary separates the spheres.
+ * Large subtrees are handed to the thread pool.
+ */
+void build_sah_node(bvh_builder_t *builder, int node_index, int first, int count, int depth) {
+  bvh_node_t &node = builder->bvh->nodes[node_index];
+  node.first = first;
+  node.count = count;
+  if(count <= BVH_LEAF_SIZE) return;
+
+  aabb_t centroids = centroid_bounds(builder, first, count);
+  position_t extent = centroids.high - centroids.low;
+  int left_count = 0;
+  if(extent.x <= 0 && extent.y <= 0 && extent.z <= 0) {
+    if(count <= BVH_MAX_LEAF_SIZE) return;
+    left_count = count / 2;
+  } else if(depth >= BVH_MAX_DEPTH) {
+    left_count = median_split(builder, first, count, centroids);
+  } else {
+    sah_bins_t bins = bin_spheres(builder, first, count, centroids);
+    int best_axis = -1, best_bin = 0;
+    double best_cost = INFINITY, node_area = 0;
+    for(int axis = 0; axis < 3; axis++) {
+      double right_area[BVH_BINS];
+      int right_count[BVH_BINS];
+      aabb_t bounds = empty_aabb();
+      int n = 0;
+      for(int bin = BVH_BINS - 1; bin > 0; bin--) {
+        bounds.extend(bins.bounds[axis][bin]);
+        n += bins.count[axis][bin];
+        right_area[bin] = bounds.surface_area();
+        right_count[bin] = n;
+      }
+      bounds = empty_aabb();
+      n = 0;
+      for(int bin = 0; bin < BVH_BINS - 1; bin++) {
+        bounds.extend(bins.bounds[axis][bin]);
+        n += bins.count[axis][bin];
+        if(n == 0 || right_count[bin + 1] == 0) continue;
+        double cost = bounds.surface_area() * n + right_area[bin + 1] * right_count[bin + 1];
+        if(cost < best_cost) {
+          best_cost = cost;
+          best_axis = axis;
+          best_bin = bin;
+          left_count = n;
+        }
+      }
+      bounds.extend(bins.bounds[axis][BVH_BINS - 1]);
+      if(n + bins.count[axis][BVH_BINS - 1] == count) node_area = bounds.surface_area();
+    }
+
+    double leaf_cost = count * BVH_INTERSECTION_COST;
+    double split_cost = best_axis == -1 || node_area == 0
+      ? INFINITY
+      : BVH_TRAVERSAL_COST + BVH_INTERSECTION_COST * best_cost / node_area;
+    if(split_cost >= leaf_cost && count <= BVH_MAX_LEAF_SIZE) return;
+
+    if(best_axis == -1) {
+      left_count = median_split(builder, first, count, centroids);
+    } else {
+      vector<bvh_ref_t> &refs = builder->refs;
+      double low = axis_value(centroids.low, best_axis);
+      double scale = BVH_BINS / axis_value(extent, best_axis);
+      partition(refs.begin() + first, refs.begin() + first + count, [&](const bvh_ref_t &ref) {
+        return bin_of(axis_value(ref.center, best_axis), low, scale) <= best_bin;
+      });
+    }
+  }
+
+  int children = builder->next_node.fetch_add(2);
+  node.first = children;
+  node.count = 0;
+  int right_first = first + left_count, right_count = count - left_count;
+  if(count > BVH_PARALLEL_THRESHOLD) {
+    thread_pool().submit(&builder->group, [builder, children, first, left_count, depth]() {
+      build_sah_node(builder, children, first, left_count, depth + 1);
+    });
+  } else {
+    build_sah_node(builder, children, first, left_count, depth + 1);
+  }
+  build_sah_node(builder, children + 1, right_first, right_count, depth + 1);
+}
+
+/**
+ * Builds the tree over arbitrary primitives with the parallel binned SAH builder, and
+ * records its cost as the reference the quality metric is compared against. Node
+ * bounds are fitted from `refs`, which the builder leaves in leaf order.
+ */
+bvh_t build_bvh_over(vector<bvh_ref_t> refs) {
+  int count = refs.size();
+  bvh_t bvh = bvh_t { vector<bvh_node_t>(), vector<int>(count), 0 };
+  if(refs.empty()) return bvh;
+  bvh.nodes.resize(2 * count - 1);
+
+  bvh_builder_t builder;
+  builder.refs = move(refs);
+  builder.bvh = &bvh;
+  builder.next_node = 1;
+  build_sah_node(&builder, 0, 0, count, 0);
+  thread_pool().wait(&builder.group);
+
+  parallel_chunks(0, count, thread_pool().size(), [&](int chunk, int begin, int end) {
+    for(int i = begin; i < end; i++) bvh.indices[i] = builder.refs[i].index;
+  });
+  bvh.nodes.resize(builder.next_node);
+  for(int i = (int) bvh.nodes.size() - 1; i >= 0; i--) {
+    bvh_node_t &node = bvh.nodes[i];
+    node.bounds = empty_aabb();
+    if(node.count > 0) {
+      for(int j = node.first; j < node.first + node.count; j++) node.bounds.extend(builder.refs[j].bounds);
+    } else {
+      node.bounds.extend(bvh.nodes[node.first].bounds);
+      node.bounds.extend(bvh.nodes[node.first + 1].bounds);
+    }
+  }
+  bvh.built_cost = sah_cost(bvh);
+  return bvh;
+}
+
+bvh_t build_bvh(const vector<sphere_t> &spheres) {
+  vector<bvh_ref_t> refs(spheres.size());
+  parallel_chunks(0, spheres.size(), thread_pool().size(), [&](int chunk, int begin, int end) {
+    for(int i = begin; i < end; i++) refs[i] = bvh_ref_t { sphere_bounds(spheres[i]), spheres[i].center, i };
+  });
+  return build_bvh_over(move(refs));
+}
+
+/**
+ * Per-frame update for moving spheres: refits the tree in place, and rebuilds it when
+ * refitting has degraded its SAH cost by more than BVH_REBUILD_RATIO. Returns true if
+ * the tree was rebuilt. The sphere count must not have changed since the build.
+ */
+bool update_bvh(bvh_t *bvh, const vector<sphere_t> &spheres) {
+  refit_bvh(bvh, spheres);
+  if(sah_cost(*bvh) <= bvh->built_cost * BVH_REBUILD_RATIO) return false;
+  *bvh = build_bvh(spheres);
+  return true;
+}
+
+/**
+ * Calls `visit_leaf` with every leaf node whose box the ray passes through.
+ */
+template <typename action>
+void traverse_bvh_leaves(const bvh_t &bvh, vector_t ray_vec, action visit_leaf) {
+  if(bvh.nodes.empty()) return;
+  position_t inverse_direction = position_t { 1.0 / ray_vec.direction.x, 1.0 / ray_vec.direction.y, 1.0 / ray_vec.direction.z };
+  int stack[BVH_STACK_SIZE];
+  int top = 0;
+  stack[top++] = 0;
+  while(top > 0) {
+    const bvh_node_t &node = bvh.nodes[stack[--top]];
+    if(!node.bounds.hit(ray_vec.origin, inverse_direction)) continue;
+    if(node.count > 0) {
+      visit_leaf(node);
+    } else {
+      stack[top++] = node.first + 1;
+      stack[top++] = node.first;
+    }
+  }
+}
+
+/**
+ * Calls `visit` with the index of every primitive in a leaf the ray passes through.
+ */
+template <typename action>
+void traverse_bvh(const bvh_t &bvh, vector_t ray_vec, action visit) {
+  traverse_bvh_leaves(bvh, ray_vec, [&](const bvh_node_t &node) {
+    for(int j = node.first; j < node.first + node.count; j++) visit(bvh.indices[j]);
+  });
+}
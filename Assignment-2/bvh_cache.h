@@ -0,0 +1,212 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "main.h"
+#include "bvh.h"
+
+/**
+ * Bumped whenever the file layout or anything that changes the built tree (the builder
+ * constants, the sphere bounds) changes, so stale files are rebuilt instead of read.
+ */
+#define BVH_CACHE_VERSION 1
+#define BVH_CACHE_MAGIC "SPHBVH\r\n"
+
+/**
+ * Fixed-size header at the start of a cache file. It is followed by `node_count`
+ * bvh_node_t records and `sphere_count` 32-bit sphere indexes, both in the layout they
+ * have in memory, with `payload_checksum` taken over the two arrays.
+ */
+struct bvh_cache_header_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t node_size;
+  uint64_t scene_hash;
+  uint64_t sphere_count;
+  uint64_t node_count;
+  uint64_t payload_checksum;
+  double built_cost;
+};
+
+/**
+ * 64-bit FNV-1a, fed value by value so struct padding never reaches the hash.
+ */
+struct scene_hasher_t {
+  uint64_t hash = 14695981039346656037ULL;
+
+  void add(const void *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char*) data;
+    for(size_t i = 0; i < size; i++) {
+      this->hash ^= bytes[i];
+      this->hash *= 1099511628211ULL;
+    }
+  }
+  void add(double value) {
+    this->add(&value, sizeof(value));
+  }
+  void add(int64_t value) {
+    this->add(&value, sizeof(value));
+  }
+};
+
+/**
+ * Hash of everything the tree depends on: the sphere count, centers and radii in order.
+ * Colors do not affect the tree and are left out.
+ */
+uint64_t scene_hash(const vector<sphere_t> &spheres) {
+  scene_hasher_t hasher;
+  hasher.add((int64_t) spheres.size());
+  for(const sphere_t & sphere : spheres) {
+    hasher.add(sphere.center.x);
+    hasher.add(sphere.center.y);
+    hasher.add(sphere.center.z);
+    hasher.add((int64_t) sphere.radius);
+  }
+  return hasher.hash;
+}
+
+/**
+ * Checksum of the arrays after the header, taken a word at a time to keep loading
+ * cheap next to the I/O. Catches damage the structural checks cannot, like a flipped
+ * bit in a bounding box.
+ */
+uint64_t payload_checksum(const char *data, size_t size) {
+  uint64_t sum = 0x9e3779b97f4a7c15ULL ^ size;
+  size_t words = size / sizeof(uint64_t);
+  for(size_t i = 0; i < words; i++) {
+    uint64_t word;
+    memcpy(&word, data + i * sizeof(uint64_t), sizeof(word));
+    sum = (sum ^ word) * 0xff51afd7ed558ccdULL;
+    sum ^= sum >> 32;
+  }
+  for(size_t i = words * sizeof(uint64_t); i < size; i++) {
+    sum = (sum ^ (unsigned char) data[i]) * 0xff51afd7ed558ccdULL;
+  }
+  return sum;
+}
+
+/**
+ * Built trees are kept in the cache directory, one file per scene named after the
+ * scene hash.
+ */
+string bvh_cache_path(const string &cache_dir, uint64_t hash) {
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.bvh", (unsigned long long) hash);
+  return cache_dir + "/" + name;
+}
+
+/**
+ * Checks that every node points inside the arrays and that children come after their
+ * parent, so a damaged file cannot send the traversal out of bounds or into a loop.
+ */
+bool valid_bvh(const bvh_t &bvh, int sphere_count) {
+  int node_count = bvh.nodes.size();
+  for(int i = 0; i < node_count; i++) {
+    const bvh_node_t &node = bvh.nodes[i];
+    if(node.count > 0) {
+      if(node.first < 0 || node.first > sphere_count - node.count) return false;
+    } else if(node.count < 0 || node.first <= i || node.first + 1 >= node_count) {
+      return false;
+    }
+  }
+  for(int index : bvh.indices) {
+    if(index < 0 || index >= sphere_count) return false;
+  }
+  return true;
+}
+
+/**
+ * Loads the tree cached in `cache_dir` for these spheres into *bvh. The file is memory-mapped and the
+ * arrays copied straight out of the mapping; they are copied rather than used in place
+ * because refitting writes to them. Returns false, leaving *bvh alone, when there is no
+ * usable file for this scene.
+ */
+bool load_cached_bvh(const string &cache_dir, const vector<sphere_t> &spheres, bvh_t *bvh) {
+  uint64_t hash = scene_hash(spheres);
+  int fd = open(bvh_cache_path(cache_dir, hash).c_str(), O_RDONLY);
+  if(fd < 0) return false;
+  struct stat info;
+  if(fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(bvh_cache_header_t)) {
+    close(fd);
+    return false;
+  }
+  size_t size = info.st_size;
+  void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(mapping == MAP_FAILED) return false;
+
+  const char *data = (const char*) mapping;
+  bvh_cache_header_t header;
+  memcpy(&header, data, sizeof(header));
+  size_t nodes_size = header.node_count * sizeof(bvh_node_t);
+  size_t indices_size = header.sphere_count * sizeof(int32_t);
+  bool usable = memcmp(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic)) == 0
+    && header.version == BVH_CACHE_VERSION
+    && header.node_size == sizeof(bvh_node_t)
+    && header.scene_hash == hash
+    && header.sphere_count == spheres.size()
+    && header.node_count <= 2 * spheres.size()
+    && size == sizeof(header) + nodes_size + indices_size
+    && header.payload_checksum == payload_checksum(data + sizeof(header), nodes_size + indices_size);
+
+  bvh_t loaded;
+  if(usable) {
+    const bvh_node_t *nodes = (const bvh_node_t*) (data + sizeof(header));
+    const int32_t *indices = (const int32_t*) (data + sizeof(header) + nodes_size);
+    loaded = bvh_t {
+      vector<bvh_node_t>(nodes, nodes + header.node_count),
+      vector<int>(indices, indices + header.sphere_count),
+      header.built_cost
+    };
+    usable = valid_bvh(loaded, spheres.size());
+  }
+  munmap(mapping, size);
+  if(usable) *bvh = move(loaded);
+  return usable;
+}
+
+/**
+ * Writes the tree for these spheres to the cache in `cache_dir`, creating the directory
+ * if it is missing. The file is written under a temporary name and renamed into place,
+ * so a concurrent or interrupted run never sees half of it. Returns false if the cache
+ * could not be written.
+ */
+bool store_cached_bvh(const string &cache_dir, const vector<sphere_t> &spheres, const bvh_t &bvh) {
+  mkdir(cache_dir.c_str(), 0755);
+  uint64_t hash = scene_hash(spheres);
+  string path = bvh_cache_path(cache_dir, hash);
+  string temporary = path + "." + to_string(getpid()) + ".tmp";
+  FILE *file = fopen(temporary.c_str(), "wb");
+  if(file == NULL) return false;
+
+  bvh_cache_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic));
+  header.version = BVH_CACHE_VERSION;
+  header.node_size = sizeof(bvh_node_t);
+  header.scene_hash = hash;
+  header.sphere_count = spheres.size();
+  header.node_count = bvh.nodes.size();
+  header.built_cost = bvh.built_cost;
+  vector<char> payload(bvh.nodes.size() * sizeof(bvh_node_t) + bvh.indices.size() * sizeof(int32_t));
+  if(!payload.empty()) {
+    memcpy(payload.data(), bvh.nodes.data(), bvh.nodes.size() * sizeof(bvh_node_t));
+    memcpy(payload.data() + bvh.nodes.size() * sizeof(bvh_node_t), bvh.indices.data(), bvh.indices.size() * sizeof(int32_t));
+  }
+  header.payload_checksum = payload_checksum(payload.data(), payload.size());
+  bool written = fwrite(&header, sizeof(header), 1, file) == 1
+    && fwrite(payload.data(), 1, payload.size(), file) == payload.size();
+  written = fclose(file) == 0 && written;
+  if(!written || rename(temporary.c_str(), path.c_str()) != 0) {
+    remove(temporary.c_str());
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <math.h>
+#include "main.h"
+
+/**
+ * Pinhole camera at `eye`, looking along `forward` with `right` and `up` spanning the
+ * image plane, all three of unit length and at right angles. The image plane lies
+ * PLANE_Z ahead of the eye and spans PLANE_START_X to PLANE_END_X along `right` and
+ * PLANE_START_Y to PLANE_END_Y along `up`, so every camera has the field of view of
+ * `default_camera`, the one the renderer always had: at `origin`, looking down z.
+ */
+struct camera_t {
+  position_t eye;
+  position_t right;
+  position_t up;
+  position_t forward;
+
+  /**
+   * Direction from the eye to the point (u, v) of the image plane, in plane units.
+   */
+  direction_t direction(double u, double v) const {
+    return direction_t {
+      this->right.x * u + this->up.x * v + this->forward.x * PLANE_Z,
+      this->right.y * u + this->up.y * v + this->forward.y * PLANE_Z,
+      this->right.z * u + this->up.z * v + this->forward.z * PLANE_Z
+    };
+  }
+  /**
+   * A world point in the camera's frame: its offsets from the eye along `right`, `up`
+   * and `forward`.
+   */
+  position_t to_camera(position_t point) const {
+    position_t rel = point - this->eye;
+    return position_t { dot(rel, this->right), dot(rel, this->up), dot(rel, this->forward) };
+  }
+};
+
+camera_t default_camera() {
+  return camera_t { origin, position_t { 1, 0, 0 }, position_t { 0, 1, 0 }, position_t { 0, 0, 1 } };
+}
+
+/**
+ * Camera at `eye` looking at `target`, turned about its axis so that `up_hint` points
+ * up in the image as far as it can. Returns false if the eye is at the target or the
+ * hint is parallel to the view direction, which leaves the camera undefined.
+ */
+bool look_at(position_t eye, position_t target, position_t up_hint, camera_t *camera) {
+  position_t view = target - eye;
+  if(view.length() == 0) return false;
+  position_t forward = normalized(view);
+  position_t side = cross(up_hint, forward);
+  if(side.length() < 1e-9 * up_hint.length()) return false;
+  position_t right = normalized(side);
+  *camera = camera_t { eye, right, cross(forward, right), forward };
+  return true;
+}
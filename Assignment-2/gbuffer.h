@@ -0,0 +1,80 @@
+#pragma once
+
+#include <vector>
+#include "main.h"
+#include "shadow_mask.h"
+#include "ray_queue.h"
+#include "camera.h"
+
+/**
+ * Primary hits of a whole frame, stored as structure of arrays so the lighting pass
+ * streams through contiguous memory. Pixel (x, y) lives at index x * height + y, the
+ * same column-major order the plane matrix uses. The primitive id doubles as the
+ * material id, since every primitive carries its own color. The camera is the one the
+ * primary rays of the frame come from.
+ */
+struct gbuffer_t {
+  int width;
+  int height;
+  camera_t camera;
+  vector<double> point_x;
+  vector<double> point_y;
+  vector<double> point_z;
+  vector<double> normal_x;
+  vector<double> normal_y;
+  vector<double> normal_z;
+  vector<int> primitive_id;
+
+  int size() const {
+    return this->width * this->height;
+  }
+  position_t point(int index) const {
+    return position_t { this->point_x[index], this->point_y[index], this->point_z[index] };
+  }
+  direction_t normal(int index) const {
+    return direction_t { this->normal_x[index], this->normal_y[index], this->normal_z[index] };
+  }
+  void store(int index, intersection_t intersection) {
+    this->point_x[index] = intersection.point.x;
+    this->point_y[index] = intersection.point.y;
+    this->point_z[index] = intersection.point.z;
+    this->normal_x[index] = intersection.normal_vector.x;
+    this->normal_y[index] = intersection.normal_vector.y;
+    this->normal_z[index] = intersection.normal_vector.z;
+    this->primitive_id[index] = intersection.primitive_id;
+  }
+};
+
+gbuffer_t make_gbuffer(int width, int height, camera_t camera = default_camera()) {
+  int size = width * height;
+  return gbuffer_t {
+    width, height, camera,
+    vector<double>(size), vector<double>(size), vector<double>(size),
+    vector<double>(size), vector<double>(size), vector<double>(size),
+    vector<int>(size, NO_PRIMITIVE)
+  };
+}
+
+/**
+ * Lighting results of a single light over the whole G-buffer: how much of it reaches
+ * each pixel, from 0 to 1 (all or nothing for a point light), and how much diffuse
+ * light it adds to each of them, along with how its shadow rays went through the scene.
+ */
+struct light_cache_t {
+  position_t position;
+  shadow_mask_t shadow_mask;
+  vector<float> visibility;
+  vector<double> contribution;
+  traversal_stats_t shadow_stats;
+};
+
+/**
+ * Everything a frame needs to be re-lit without re-tracing visibility: the primary
+ * hits and the per-light results. Since contributions are never negative, clamping
+ * the summed contributions gives the same lustre as clamping after every light, so
+ * lights can be recomputed independently of each other.
+ */
+struct render_cache_t {
+  gbuffer_t gbuffer;
+  vector<light_cache_t> lights;
+};
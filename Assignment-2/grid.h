@@ -0,0 +1,241 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include "main.h"
+#include "bvh.h"
+
+/**
+ * Target number of cells per sphere. The top level is capped at GRID_MAX_RESOLUTION
+ * cells per axis, which bounds its memory for huge scenes.
+ */
+#define GRID_DENSITY 2.0
+#define GRID_MAX_RESOLUTION 256
+
+/**
+ * In a two-level grid, top level cells holding more spheres than this get a grid of
+ * their own, of at most GRID_MAX_SUBGRID_RESOLUTION cells per axis.
+ */
+#define GRID_SUBGRID_THRESHOLD 16
+#define GRID_MAX_SUBGRID_RESOLUTION 16
+
+/**
+ * Uniform grid over `bounds`. The spheres overlapping cell c are
+ * items[cell_start[c], cell_start[c + 1]), cells being numbered (x * ry + y) * rz + z.
+ */
+struct grid_level_t {
+  aabb_t bounds;
+  int resolution[3];
+  double cell_size[3];
+  vector<int> cell_start;
+  vector<int> items;
+
+  int cell_count() const {
+    return this->resolution[0] * this->resolution[1] * this->resolution[2];
+  }
+  int cell_index(int x, int y, int z) const {
+    return (x * this->resolution[1] + y) * this->resolution[2] + z;
+  }
+  /**
+   * Cell coordinate of a value on an axis, clamped into the grid.
+   */
+  int coordinate(double value, int axis) const {
+    double low = axis_value(this->bounds.low, axis);
+    int c = (int) floor((value - low) / this->cell_size[axis]);
+    return max(0, min(this->resolution[axis] - 1, c));
+  }
+  aabb_t cell_bounds(int x, int y, int z) const {
+    position_t low = this->bounds.low;
+    low = low + position_t { x * this->cell_size[0], y * this->cell_size[1], z * this->cell_size[2] };
+    return aabb_t { low, low + position_t { this->cell_size[0], this->cell_size[1], this->cell_size[2] } };
+  }
+};
+
+/**
+ * Uniform grid over the sphere list, optionally two-level: `cell_child` maps every top
+ * level cell to the index of its subgrid in `subgrids`, or -1 if its spheres are
+ * listed in the top level itself. One-level grids leave `cell_child` empty.
+ */
+struct sphere_grid_t {
+  grid_level_t top;
+  vector<int> cell_child;
+  vector<grid_level_t> subgrids;
+  int sphere_count;
+};
+
+/**
+ * Resolution giving roughly density * count cubic cells over the bounds.
+ */
+void grid_resolution(aabb_t bounds, int count, double density, int max_resolution, int *resolution) {
+  position_t extent = bounds.high - bounds.low;
+  double volume = extent.x * extent.y * extent.z;
+  double cells_per_unit = volume > 0 ? cbrt(density * max(1, count) / volume) : 0;
+  double extents[3] = { extent.x, extent.y, extent.z };
+  for(int axis = 0; axis < 3; axis++) {
+    resolution[axis] = max(1, min(max_resolution, (int) ceil(extents[axis] * cells_per_unit)));
+  }
+}
+
+/**
+ * Builds one grid level over the given spheres in two passes: one counting the
+ * spheres overlapping each cell, one filling the cell lists after a prefix sum.
+ * Linear in the number of (sphere, cell) overlaps.
+ */
+grid_level_t build_grid_level(const vector<sphere_t> &spheres, const vector<int> &ids, aabb_t bounds,
+                              double density, int max_resolution) {
+  grid_level_t grid;
+  grid.bounds = bounds;
+  grid_resolution(bounds, ids.size(), density, max_resolution, grid.resolution);
+  position_t extent = bounds.high - bounds.low;
+  double extents[3] = { extent.x, extent.y, extent.z };
+  for(int axis = 0; axis < 3; axis++) {
+    grid.cell_size[axis] = extents[axis] > 0 ? extents[axis] / grid.resolution[axis] : 1;
+  }
+  grid.cell_start.assign(grid.cell_count() + 1, 0);
+
+  vector<int> ranges(ids.size() * 6);
+  for(int i = 0; i < (int) ids.size(); i++) {
+    aabb_t box = sphere_bounds(spheres[ids[i]]);
+    int *range = &ranges[i * 6];
+    for(int axis = 0; axis < 3; axis++) {
+      range[axis] = grid.coordinate(axis_value(box.low, axis), axis);
+      range[axis + 3] = grid.coordinate(axis_value(box.high, axis), axis);
+    }
+    for(int x = range[0]; x <= range[3]; x++) {
+      for(int y = range[1]; y <= range[4]; y++) {
+        for(int z = range[2]; z <= range[5]; z++) grid.cell_start[grid.cell_index(x, y, z) + 1]++;
+      }
+    }
+  }
+  for(int c = 0; c < grid.cell_count(); c++) grid.cell_start[c + 1] += grid.cell_start[c];
+
+  grid.items.resize(grid.cell_start.back());
+  vector<int> fill(grid.cell_start.begin(), grid.cell_start.end() - 1);
+  for(int i = 0; i < (int) ids.size(); i++) {
+    const int *range = &ranges[i * 6];
+    for(int x = range[0]; x <= range[3]; x++) {
+      for(int y = range[1]; y <= range[4]; y++) {
+        for(int z = range[2]; z <= range[5]; z++) grid.items[fill[grid.cell_index(x, y, z)]++] = ids[i];
+      }
+    }
+  }
+  return grid;
+}
+
+/**
+ * Builds the grid over all spheres. With `two_level`, crowded cells of the top level
+ * are refined by a grid of their own, which keeps clustered scenes from piling hundreds
+ * of spheres into a single cell.
+ */
+sphere_grid_t build_grid(const vector<sphere_t> &spheres, bool two_level) {
+  aabb_t bounds = empty_aabb();
+  vector<int> ids(spheres.size());
+  for(int i = 0; i < (int) spheres.size(); i++) {
+    bounds.extend(sphere_bounds(spheres[i]));
+    ids[i] = i;
+  }
+  sphere_grid_t grid;
+  grid.sphere_count = spheres.size();
+  if(spheres.empty()) bounds = aabb_t { origin, origin };
+  grid.top = build_grid_level(spheres, ids, bounds, GRID_DENSITY, GRID_MAX_RESOLUTION);
+  if(!two_level) return grid;
+
+  const grid_level_t &top = grid.top;
+  grid.cell_child.assign(top.cell_count(), -1);
+  for(int x = 0; x < top.resolution[0]; x++) {
+    for(int y = 0; y < top.resolution[1]; y++) {
+      for(int z = 0; z < top.resolution[2]; z++) {
+        int c = top.cell_index(x, y, z);
+        int count = top.cell_start[c + 1] - top.cell_start[c];
+        if(count <= GRID_SUBGRID_THRESHOLD) continue;
+        vector<int> cell_ids(top.items.begin() + top.cell_start[c], top.items.begin() + top.cell_start[c + 1]);
+        grid.cell_child[c] = grid.subgrids.size();
+        grid.subgrids.push_back(build_grid_level(spheres, cell_ids, top.cell_bounds(x, y, z), GRID_DENSITY, GRID_MAX_SUBGRID_RESOLUTION));
+      }
+    }
+  }
+  return grid;
+}
+
+/**
+ * 3D-DDA through one grid level: calls visit_cell(cell, t_enter, t_exit) for every
+ * cell the ray origin + t * direction crosses within [t_min, t_max], in ray order.
+ */
+template <typename action>
+void walk_grid_level(const grid_level_t &grid, position_t ray_origin, position_t direction, position_t inverse_direction,
+                     double t_min, double t_max, action visit_cell) {
+  if(!grid.bounds.clip(ray_origin, inverse_direction, &t_min, &t_max)) return;
+  double o[3] = { ray_origin.x, ray_origin.y, ray_origin.z };
+  double d[3] = { direction.x, direction.y, direction.z };
+  double inv[3] = { inverse_direction.x, inverse_direction.y, inverse_direction.z };
+  int cell[3], step[3];
+  double next[3], delta[3];
+  for(int axis = 0; axis < 3; axis++) {
+    cell[axis] = grid.coordinate(o[axis] + d[axis] * t_min, axis);
+    double low = axis_value(grid.bounds.low, axis);
+    if(d[axis] > 0) {
+      step[axis] = 1;
+      next[axis] = (low + (cell[axis] + 1) * grid.cell_size[axis] - o[axis]) * inv[axis];
+      delta[axis] = grid.cell_size[axis] * inv[axis];
+    } else if(d[axis] < 0) {
+      step[axis] = -1;
+      next[axis] = (low + cell[axis] * grid.cell_size[axis] - o[axis]) * inv[axis];
+      delta[axis] = -grid.cell_size[axis] * inv[axis];
+    } else {
+      step[axis] = 0;
+      next[axis] = INFINITY;
+      delta[axis] = INFINITY;
+    }
+  }
+
+  double t = t_min;
+  while(true) {
+    int axis = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+    double t_exit = min(next[axis], t_max);
+    visit_cell(grid.cell_index(cell[0], cell[1], cell[2]), t, t_exit);
+    if(next[axis] > t_max) return;
+    cell[axis] += step[axis];
+    if(cell[axis] < 0 || cell[axis] >= grid.resolution[axis]) return;
+    t = next[axis];
+    next[axis] += delta[axis];
+  }
+}
+
+/**
+ * Calls `visit` with the index of every sphere in a cell the ray passes through. A
+ * sphere overlapping several of those cells is reported once per ray, by stamping it
+ * with the ray's number in a per-thread mailbox.
+ */
+template <typename action>
+void traverse_grid(const sphere_grid_t &grid, vector_t ray_vec, action visit) {
+  thread_local vector<unsigned> mailbox;
+  thread_local unsigned ray_number = 0;
+  if((int) mailbox.size() < grid.sphere_count) mailbox.resize(grid.sphere_count, 0);
+  if(++ray_number == 0) {
+    fill(mailbox.begin(), mailbox.end(), 0);
+    ray_number = 1;
+  }
+
+  position_t direction = ray_vec.direction.approximate();
+  position_t inverse_direction = position_t { 1.0 / direction.x, 1.0 / direction.y, 1.0 / direction.z };
+  auto visit_items = [&](const grid_level_t &level, int cell) {
+    for(int j = level.cell_start[cell]; j < level.cell_start[cell + 1]; j++) {
+      int sphere = level.items[j];
+      if(mailbox[sphere] == ray_number) continue;
+      mailbox[sphere] = ray_number;
+      visit(sphere);
+    }
+  };
+  walk_grid_level(grid.top, ray_vec.origin, direction, inverse_direction, 0, INFINITY, [&](int cell, double t_enter, double t_exit) {
+    int child = grid.cell_child.empty() ? -1 : grid.cell_child[cell];
+    if(child == -1) {
+      visit_items(grid.top, cell);
+      return;
+    }
+    const grid_level_t &subgrid = grid.subgrids[child];
+    walk_grid_level(subgrid, ray_vec.origin, direction, inverse_direction, t_enter, t_exit, [&](int sub_cell, double, double) {
+      visit_items(subgrid, sub_cell);
+    });
+  });
+}
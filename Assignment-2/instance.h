@@ -0,0 +1,144 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <math.h>
+#include "main.h"
+#include "bvh.h"
+#include "mesh.h"
+
+/**
+ * Affine transform: the top three rows of a 4x4 matrix like Object3D's modelMatrix,
+ * m[row][column], with the translation in column 3.
+ */
+struct transform_t {
+  double m[3][4];
+
+  position_t apply_point(position_t p) const {
+    return position_t {
+      this->m[0][0] * p.x + this->m[0][1] * p.y + this->m[0][2] * p.z + this->m[0][3],
+      this->m[1][0] * p.x + this->m[1][1] * p.y + this->m[1][2] * p.z + this->m[1][3],
+      this->m[2][0] * p.x + this->m[2][1] * p.y + this->m[2][2] * p.z + this->m[2][3]
+    };
+  }
+  position_t apply_direction(position_t d) const {
+    return position_t {
+      this->m[0][0] * d.x + this->m[0][1] * d.y + this->m[0][2] * d.z,
+      this->m[1][0] * d.x + this->m[1][1] * d.y + this->m[1][2] * d.z,
+      this->m[2][0] * d.x + this->m[2][1] * d.y + this->m[2][2] * d.z
+    };
+  }
+  /**
+   * Applies the transpose of the linear part. For the inverse of a transform this maps
+   * object space normals to world space ones.
+   */
+  position_t apply_transposed(position_t n) const {
+    return position_t {
+      this->m[0][0] * n.x + this->m[1][0] * n.y + this->m[2][0] * n.z,
+      this->m[0][1] * n.x + this->m[1][1] * n.y + this->m[2][1] * n.z,
+      this->m[0][2] * n.x + this->m[1][2] * n.y + this->m[2][2] * n.z
+    };
+  }
+};
+
+transform_t identity_transform() {
+  return transform_t { { { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 } } };
+}
+
+/**
+ * Inverts a transform through the adjugate of its linear part. Returns false if the
+ * transform is singular.
+ */
+bool invert_transform(const transform_t &transform, transform_t *inverse) {
+  const double (*m)[4] = transform.m;
+  double cofactor[3][3];
+  for(int row = 0; row < 3; row++) {
+    for(int column = 0; column < 3; column++) {
+      int r1 = (row + 1) % 3, r2 = (row + 2) % 3, c1 = (column + 1) % 3, c2 = (column + 2) % 3;
+      cofactor[row][column] = m[r1][c1] * m[r2][c2] - m[r1][c2] * m[r2][c1];
+    }
+  }
+  double determinant = m[0][0] * cofactor[0][0] + m[0][1] * cofactor[0][1] + m[0][2] * cofactor[0][2];
+  if(determinant == 0 || !isfinite(determinant)) return false;
+  for(int row = 0; row < 3; row++) {
+    for(int column = 0; column < 3; column++) inverse->m[row][column] = cofactor[column][row] / determinant;
+  }
+  for(int row = 0; row < 3; row++) {
+    inverse->m[row][3] = -(inverse->m[row][0] * m[0][3] + inverse->m[row][1] * m[1][3] + inverse->m[row][2] * m[2][3]);
+  }
+  return true;
+}
+
+/**
+ * Box around a transformed box: the center is transformed, and the half extent on each
+ * world axis is what the absolute values of the linear part make of the local one.
+ */
+aabb_t transform_bounds(const transform_t &transform, aabb_t box) {
+  if(box.low.x > box.high.x) return box;
+  position_t center = transform.apply_point((box.low + box.high) * 0.5);
+  position_t half = (box.high - box.low) * 0.5;
+  double extent[3];
+  for(int row = 0; row < 3; row++) {
+    extent[row] = fabs(transform.m[row][0]) * half.x + fabs(transform.m[row][1]) * half.y + fabs(transform.m[row][2]) * half.z;
+  }
+  position_t world_half = position_t { extent[0], extent[1], extent[2] };
+  return aabb_t { center - world_half, center + world_half };
+}
+
+/**
+ * A group of spheres placed as a whole by instances, with its own BVH. `first_id` is
+ * the primitive id of its first sphere.
+ */
+struct sphere_cluster_t {
+  string name;
+  vector<sphere_t> spheres;
+  bvh_t bvh;
+  int first_id;
+
+  aabb_t bounds() const {
+    return this->bvh.nodes.empty() ? empty_aabb() : this->bvh.nodes[0].bounds;
+  }
+};
+
+enum geometry_kind_t {
+  GEOMETRY_MESH,
+  GEOMETRY_CLUSTER
+};
+
+/**
+ * One placement of a shared mesh or sphere cluster. Rays are taken into object space
+ * by `to_object` and traced against the shared structure there; since the transform is
+ * affine, the ray parameter of a hit is the same in both spaces. `bounds` is the world
+ * space box the top level BVH is built over.
+ */
+struct instance_t {
+  geometry_kind_t kind;
+  int geometry;
+  transform_t to_world;
+  transform_t to_object;
+  aabb_t bounds;
+};
+
+/**
+ * Makes an instance of the given geometry, or returns false if the transform is
+ * singular. Its bounds are filled in when the top level is built.
+ */
+bool make_instance(geometry_kind_t kind, int geometry, transform_t to_world, instance_t *instance) {
+  *instance = instance_t { kind, geometry, to_world };
+  return invert_transform(to_world, &instance->to_object);
+}
+
+vector_t object_ray(const instance_t &instance, vector_t ray_vec) {
+  return vector_t {
+    instance.to_object.apply_point(ray_vec.origin),
+    pos_to_dir(instance.to_object.apply_direction(ray_vec.direction.approximate()))
+  };
+}
+
+/**
+ * World space normal of an object space normal. Normals go through the inverse
+ * transpose, which keeps them perpendicular to surfaces under non-uniform scaling.
+ */
+position_t world_normal(const instance_t &instance, position_t normal) {
+  return instance.to_object.apply_transposed(normal);
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <fstream>
+#include "main.h"
+#include "scene.h"
+#include "scene_file.h"
+#include "ply_scene.h"
+
+/**
+ * Loads a scene from a binary, PLY or text scene file, telling the formats apart by
+ * their first bytes.
+ */
+bool load_any_scene(const string &path, input_data_t *input_data, string *error) {
+  if(is_binary_scene(path)) return load_binary_scene(path, input_data, error);
+  if(is_ply_scene(path)) return load_ply_scene(path, input_data, error);
+  return load_text_scene(path, input_data, error);
+}
+
+/**
+ * Path of a file named in the file at `from`: relative names are taken from the
+ * directory `from` is in, so that a file works from wherever it is loaded.
+ */
+string path_next_to(const string &from, const string &name) {
+  size_t slash = from.rfind('/');
+  if(name.empty() || name[0] == '/' || slash == string::npos) return name;
+  return from.substr(0, slash + 1) + name;
+}
+
+/**
+ * Loads an instance file into the scene, one declaration per line:
+ *
+ *   mesh file.ply              a triangle mesh, read like `load_ply_mesh` does
+ *   cluster file               the spheres of a scene file, in any scene format
+ *   instance g m00 m01 m02 m03 m10 m11 m12 m13 m20 m21 m22 m23
+ *
+ * Meshes and clusters are numbered together from 0 in the order they are declared in
+ * the file, and an instance places geometry g with the given rows of its model matrix.
+ * Relative file names are taken from the directory of the instance file, not the one
+ * the renderer runs in. Blank lines and lines starting with '#' are skipped. The shared geometry is only
+ * loaded once, however many instances use it; the top level is left to
+ * `build_instances`.
+ */
+bool load_instance_file(const string &path, input_data_t *input_data, string *error) {
+  ifstream file(path);
+  if(!file) {
+    *error = "cannot open " + path;
+    return false;
+  }
+  vector<geometry_kind_t> kinds;
+  vector<int> indexes;
+  string line;
+  for(int number = 1; getline(file, line); number++) {
+    const char *p = line.data(), *line_end = line.data() + line.size();
+    while(p < line_end && is_blank(*p)) p++;
+    const char *kind = p;
+    while(p < line_end && !is_blank(*p)) p++;
+    string_view keyword(kind, p - kind);
+    while(p < line_end && is_blank(*p)) p++;
+    string argument(p, line_end);
+    while(!argument.empty() && is_blank(argument.back())) argument.pop_back();
+    string where = path + ", line " + to_string(number) + ": ";
+
+    if(keyword.empty() || keyword[0] == '#') continue;
+    if(keyword == "mesh") {
+      mesh_t mesh;
+      if(!load_ply_mesh(path_next_to(path, argument), &mesh, error)) {
+        *error = where + *error;
+        return false;
+      }
+      kinds.push_back(GEOMETRY_MESH);
+      indexes.push_back(input_data->meshes.size());
+      input_data->meshes.push_back(move(mesh));
+    } else if(keyword == "cluster") {
+      input_data_t cluster_scene;
+      if(!load_any_scene(path_next_to(path, argument), &cluster_scene, error)) {
+        *error = where + *error;
+        return false;
+      }
+      if(cluster_scene.spheres.empty()) {
+        *error = where + argument + " has no spheres";
+        return false;
+      }
+      bvh_t bvh = build_bvh(cluster_scene.spheres);
+      kinds.push_back(GEOMETRY_CLUSTER);
+      indexes.push_back(input_data->clusters.size());
+      input_data->clusters.push_back(sphere_cluster_t { argument, move(cluster_scene.spheres), move(bvh) });
+    } else if(keyword == "instance") {
+      int geometry = -1;
+      transform_t to_world;
+      p = argument.data();
+      const char *end = argument.data() + argument.size();
+      bool parsed = read_field(&p, end, &geometry);
+      for(int i = 0; i < 12 && parsed; i++) parsed = read_field(&p, end, &to_world.m[i / 4][i % 4]);
+      instance_t instance;
+      if(!parsed || p != end || geometry < 0 || geometry >= (int) kinds.size()) {
+        *error = where + "cannot read \"" + line + "\"";
+        return false;
+      }
+      if(!make_instance(kinds[geometry], indexes[geometry], to_world, &instance)) {
+        *error = where + "the transform is singular";
+        return false;
+      }
+      input_data->instances.push_back(instance);
+    } else {
+      *error = where + "cannot read \"" + line + "\"";
+      return false;
+    }
+  }
+  return true;
+}
@@ -3,8 +3,25 @@
 #include <math.h>
 #include <queue>
 #include <algorithm>
+#include <chrono>
 #include "bitmap_image.hpp"
 #include "main.h"
+#include "scene.h"
+#include "primitives.h"
+#include "ray_queue.h"
+#include "bvh_cache.h"
+#include "options.h"
+#include "scene_file.h"
+#include "ply_scene.h"
+#include "instance_file.h"
+#include "shadow_mask.h"
+#include "gbuffer.h"
+#include "tiles.h"
+#include "scene_diff.h"
+#include "camera.h"
+#include "view_file.h"
+#include "reprojection.h"
+#include "sequence_file.h"
 
 using namespace std;
 
@@ -23,23 +40,6 @@ color_t** init_plane() {
   return plane;
 }
 
-/**
- * Invoke the action for all plane. Action is essentially a lambda
- * that will be run with the positions on the plane. It's practically for
- * shooting rays conventionally.
- */
-template <typename action>
-void forall_plane(color_t** plane, action act) {
-  for(int x = 0; x < PLANE_WIDTH * RESOLUTION_COEFF; x++) {
-    for(int y = 0; y < PLANE_HEIGHT * RESOLUTION_COEFF; y++) {
-      plane[x][y] = act(
-        ((double) x) / RESOLUTION_COEFF + PLANE_START_X,
-        ((double) y) / RESOLUTION_COEFF + PLANE_START_Y
-      ); // Shifting indexes of plane matrix accordingly
-    }
-  }
-}
-
 /**
  * Write an annotation for a property of an object.
  */
@@ -61,138 +61,439 @@ void color_annot(string color_component, int sphere_number, string object) {
   annot("Color (" + color_component + ")", sphere_number, object);
 }
 
-quadratic_result quadratic(double A, double B, double C, double *result1, double *result2) {
-  double discr = B * B - 4 * A * C;
-  if(discr < 0) {
-    // No intersection
-    return NO_ROOT;
-  } else if (discr == 0) {
-    *result1 = -B / (2 * A);
-    return ONE_ROOT;
-  } else {
-    *result1 = (-B - sqrt(discr)) / (2 * A);
-    *result2 = (-B + sqrt(discr)) / (2 * A);
-    return TWO_ROOTS;
+bool between(position_t point, position_t start, position_t end) {
+  return (point - start).length() <= (end - start).length() &&
+    (end - point).length() <= (end - start).length();
+}
+/**
+ * Whether a hit found on the way from `point` to the light blocks it: any hit does,
+ * unless it is beyond the light or too close to the point to be told apart from it.
+ */
+bool blocks_light(position_t point, position_t light_pos, position_t hit_point) {
+  return !between(light_pos, point, hit_point) && !hit_point.too_close(point);
+}
+
+/**
+ * Given a point and the scene, tells whether the light reaches that point. Hits are
+ * checked with `blocks_light` as they are found instead of being sorted.
+ */
+bool light_visible(position_t point, const input_data_t &input_data, position_t light_pos) {
+  if(DEBUG) {
+    cout << "-- Shadowing --" << endl;
+    cout << "Focus Point: ";
+    point.print();
+    cout << "Vector: ";
+    (light_pos - point).print();
   }
+  vector_t shadow_vec = vector_t { point, pos_to_dir(light_pos - point) };
+  bool visible = true;
+  intersect_primitives(input_data, shadow_vec, [&](const intersection_t &intersection) {
+    if(blocks_light(point, light_pos, intersection.point)) visible = false;
+  });
+  if(DEBUG) cout << "-----------------------------------------------" << endl;
+  return visible;
 }
 
-vector<intersection_t> *ray_sphere_intersections(vector_t ray_vec, sphere_t sphere) {
-  vector<intersection_t> *intersections = new vector<intersection_t>();
-  double A = ray_vec.direction.dot(ray_vec.direction);
-  double B = 2 * (ray_vec.direction.dot(ray_vec.origin - sphere.center));
-  double C = pow((ray_vec.origin - sphere.center).length(), 2) - pow(sphere.radius, 2);
-  double t1, t2;
-  quadratic_result result = quadratic(A, B, C, &t1, &t2);
+/**
+ * Keeps the closer of `*closest` and a new hit of a ray from `ray_origin`, ignoring hits
+ * at the camera itself, or too close to the ray's origin to be told apart from the
+ * surface a reflection ray leaves. On equal distances the hit found first stays.
+ */
+void keep_closest(position_t ray_origin, const intersection_t &intersection, intersection_t *closest, double *closest_distance) {
+  position_t hit_point = intersection.point;
+  if(hit_point == origin || hit_point.too_close(ray_origin)) return;
+  double distance = (hit_point - ray_origin).length();
+  if(distance < *closest_distance) {
+    *closest_distance = distance;
+    *closest = intersection;
+  }
+}
+
+/**
+ * Shoots the given ray vector into the scene and returns the closest intersection. If
+ * nothing is hit, the returned intersection has NO_PRIMITIVE as its id.
+ */
+intersection_t shoot_ray(vector_t ray_vec, const input_data_t &input_data) {
+  intersection_t closest_intersection = intersection_t { white_color, ray_vec.origin, direction_t { 0, 0, 0 } };
+  double closest_distance = INFINITY;
+  intersect_primitives(input_data, ray_vec, [&](const intersection_t &intersection) {
+    keep_closest(ray_vec.origin, intersection, &closest_intersection, &closest_distance);
+  });
+  return closest_intersection;
+}
 
-  if(result == NO_ROOT) {
-    // No intersection
-  } else if (result == ONE_ROOT) {
-    // One intersection
-    position_t point = ray_vec.origin + (ray_vec.direction * t1).approximate();
-    intersections->push_back(intersection_t { sphere.color, point, sphere_normal_vector(sphere, point) });
-  } else if (result == TWO_ROOTS) {
-    // Two intersections
-    position_t point1 = ray_vec.origin + (ray_vec.direction * t1).approximate();
-    position_t point2 = ray_vec.origin + (ray_vec.direction * t2).approximate();
+/**
+ * Primary ray of the camera through the point (x, y) of the image, in pixels, which
+ * lies RESOLUTION_COEFF pixels to the plane unit from (PLANE_START_X, PLANE_START_Y)
+ * on the image plane. Pixel (x, y) is sampled at its corner (x, y); samples inside it
+ * take fractional coordinates.
+ */
+vector_t primary_ray(const camera_t &camera, double x, double y) {
+  return vector_t { camera.eye, camera.direction(x / RESOLUTION_COEFF + PLANE_START_X, y / RESOLUTION_COEFF + PLANE_START_Y) };
+}
 
-    if(t1 >= 0) intersections->push_back(intersection_t { sphere.color, point1, sphere_normal_vector(sphere, point1) });
-    if(t2 >= 0) intersections->push_back(intersection_t { sphere.color, point2, sphere_normal_vector(sphere, point2) });
-  }
+/**
+ * Color of the primitive with the given id, or white for the background.
+ */
+color_t primitive_color(const input_data_t &input_data, int primitive_id) {
+  color_t color = white_color;
+  if(primitive_id != NO_PRIMITIVE) registered_color(input_data, primitive_id, &color);
+  return color;
+}
 
-  return intersections;
+/**
+ * Share of the light reaching the primitive with the given id that it mirrors: the
+ * scene spheres and the ground plane reflect as the command line says, nothing else
+ * does.
+ */
+double reflectivity(const input_data_t &input_data, int primitive_id) {
+  if(primitive_id == GROUND_PLANE_ID) return input_data.plane_reflectivity;
+  if(primitive_id >= 0 && primitive_id < (int) input_data.spheres.size()) return input_data.sphere_reflectivity;
+  return 0;
 }
 
-vector<intersection_t> *ray_plane_intersections(vector_t ray_vec, plane_t plane) {
-  vector<intersection_t> *intersections = new vector<intersection_t>();
-  position_t p0 = plane.point;
-  position_t l0 = ray_vec.origin;
-  direction_t n = plane.normal_vector;
-  direction_t l = ray_vec.direction;
-  if(n.dot(l) == 0) cout << "wow" << endl;
-  double t = pos_to_dir(p0 - l0).dot(n) / l.dot(n);
-  position_t intersection_point = ray_vec.origin + (ray_vec.direction * t).approximate();
-  if(t >= 0)
-    intersections->push_back(intersection_t { plane.color, intersection_point, plane.normal_vector });
-  return intersections;
+bool has_reflections(const input_data_t &input_data) {
+  return input_data.sphere_reflectivity > 0 || input_data.plane_reflectivity > 0;
 }
 
 /**
- * This is the heart of the program. This function takes a ray vector and a list of
- * spheres, and returns a SORTED list of intersections, which if popped from back, returns
- * intersections that are closest first.
+ * The passes below are wavefront stages: a pass first queues the rays of all its tiles,
+ * then intersects the queue batch by batch, each batch with every primitive type in
+ * turn, and only then consumes the results. No ray is traced on its own. The tiles are
+ * taken in `input_data.tile_order` and split into runs of consecutive tiles, and every
+ * run goes through the stages on its own thread with its own queue.
  */
-vector<intersection_t> *ray_intersections(vector_t ray_vec, vector<sphere_t> spheres, plane_t ground_plane) {
 
-  vector<intersection_t> *intersections = new vector<intersection_t>();
+/**
+ * The frame's tiles in the render order.
+ */
+vector<tile_t> render_tiles(const input_data_t &input_data, int width, int height) {
+  return order_tiles(frame_tiles(width, height), input_data.tile_order);
+}
 
-  /* Ray-Sphere Intersections */
-  for(const sphere_t & sphere : spheres) {
-    for(const intersection_t & intersection : *ray_sphere_intersections(ray_vec, sphere)) {
-      intersections->push_back(intersection);
+/**
+ * G-buffer indexes of the pixels of the tiles, tile by tile.
+ */
+vector<int> tile_pixels(const vector<tile_t> &tiles, int height) {
+  vector<int> pixels;
+  for(tile_t tile : tiles) {
+    for(int x = tile.x_start; x < tile.x_end; x++) {
+      for(int y = tile.y_start; y < tile.y_end; y++) pixels.push_back(x * height + y);
     }
   }
-  for(const intersection_t & intersection : *ray_plane_intersections(ray_vec, ground_plane)) {
-    intersections->push_back(intersection);
+  return pixels;
+}
+
+/**
+ * Queues the primary rays of pixels [begin, end) of the list. Lists come tile by tile,
+ * so the rays of a batch stay close to each other.
+ */
+void queue_primary_rays(ray_queue_t *queue, const gbuffer_t &gbuffer, const vector<int> &pixels, int begin, int end) {
+  int height = gbuffer.height;
+  for(int p = begin; p < end; p++) {
+    queue->push(pixels[p], primary_ray(gbuffer.camera, pixels[p] / height, pixels[p] % height));
   }
+}
 
-  sort(intersections->begin(), intersections->end(), [&ray_vec](intersection_t l, intersection_t r) {
-    return (l.point - ray_vec.origin).length() > (r.point - ray_vec.origin).length(); 
+/**
+ * Closest hit of every queued ray, as `shoot_ray` finds it, stored into the G-buffer at
+ * the ray's pixel.
+ */
+void trace_queue(gbuffer_t *gbuffer, const input_data_t &input_data, const ray_queue_t &queue) {
+  vector<intersection_t> closest;
+  vector<double> closest_distance;
+  for_each_batch(queue, [&](int first, int last) {
+    closest.clear();
+    closest_distance.assign(last - first, INFINITY);
+    for(int r = first; r < last; r++) {
+      closest.push_back(intersection_t { white_color, queue.origin(r), direction_t { 0, 0, 0 } });
+    }
+    intersect_queue_primitives(input_data, queue, first, last, [](int r) { return true; }, [&](int r, const intersection_t &intersection) {
+      keep_closest(queue.origin(r), intersection, &closest[r - first], &closest_distance[r - first]);
+    });
+    for(int r = first; r < last; r++) {
+      gbuffer->store(queue.pixel[r], closest[r - first]);
+    }
   });
-  return intersections;
 }
 
-bool between(position_t point, position_t start, position_t end) {
-  return (point - start).length() <= (end - start).length() &&
-    (end - point).length() <= (end - start).length();
+/**
+ * First pass of the deferred renderer: visibility only. The closest hit of every listed
+ * pixel is recorded in the G-buffer, no lighting is done here. The list is split into
+ * runs of consecutive pixels for the thread pool. Returns how the primary rays went
+ * through the scene.
+ */
+traversal_stats_t trace_pixels(gbuffer_t *gbuffer, const input_data_t &input_data, const vector<int> &pixels) {
+  vector<traversal_stats_t> run_stats(tile_runs());
+  parallel_chunks(0, pixels.size(), tile_runs(), [&](int run, int begin, int end) {
+    ray_queue_t queue;
+    queue_primary_rays(&queue, *gbuffer, pixels, begin, end);
+    trace_queue(gbuffer, input_data, queue);
+    run_stats[run] = queue.stats;
+  });
+  traversal_stats_t stats;
+  for(const traversal_stats_t & run : run_stats) stats.add(run);
+  return stats;
+}
+
+traversal_stats_t trace_tiles(gbuffer_t *gbuffer, const input_data_t &input_data, const vector<tile_t> &tiles) {
+  return trace_pixels(gbuffer, input_data, tile_pixels(tiles, gbuffer->height));
 }
+
+gbuffer_t trace_gbuffer(const input_data_t &input_data, traversal_stats_t *stats) {
+  gbuffer_t gbuffer = make_gbuffer(IMAGE_WIDTH, IMAGE_HEIGHT);
+  *stats = trace_tiles(&gbuffer, input_data, render_tiles(input_data, gbuffer.width, gbuffer.height));
+  return gbuffer;
+}
+
 /**
- * Given an intersection and a list of spheres, shadows that point if necessary.
+ * Traces the queued shadow rays, ray r towards the point of the light target(r), and
+ * tells which of them are blocked. A ray leaves the traversal as soon as it is found
+ * blocked.
  */
-void illuminate_point(intersection_t* focus_intersection, vector<sphere_t> spheres, plane_t ground_plane, position_t light_pos) {
-  if(DEBUG) {
-    cout << "-- Shadowing --" << endl;
-    cout << "Focus Point: ";
-    focus_intersection->point.print();
-    cout << "Vector: ";
-    (light_pos - focus_intersection->point).print();
+template <typename light_point>
+vector<unsigned char> trace_shadow_rays(const input_data_t &input_data, const ray_queue_t &queue, light_point target) {
+  vector<unsigned char> blocked(queue.size(), false);
+  for_each_batch(queue, [&](int first, int last) {
+    intersect_queue_primitives(input_data, queue, first, last, [&](int r) { return !blocked[r]; },
+      [&](int r, const intersection_t &intersection) {
+        if(blocks_light(queue.origin(r), target(r), intersection.point)) blocked[r] = true;
+      });
+  });
+  return blocked;
+}
+
+/**
+ * Traces the queued shadow rays towards the light and records which of their pixels it
+ * reaches.
+ */
+void trace_shadow_queue(const input_data_t &input_data, const ray_queue_t &queue, light_cache_t *light) {
+  vector<unsigned char> blocked = trace_shadow_rays(input_data, queue, [&](int r) { return light->position; });
+  for(int r = 0; r < queue.size(); r++) {
+    light->visibility[queue.pixel[r]] = !blocked[r];
+  }
+}
+
+/**
+ * Sample k of `count` on a spherical light of the given center and radius, seen from
+ * `point`: samples follow a sunflower spiral over the disc the light shows the point,
+ * so any run of them covers equal areas of it, and the spiral is turned by `turn`
+ * radians.
+ */
+position_t area_light_sample(position_t point, position_t center, double radius, int k, int count, double turn) {
+  position_t u_axis, v_axis;
+  plane_axes(center - point, &u_axis, &v_axis);
+  double distance = radius * sqrt((k + 0.5) / count);
+  double angle = k * M_PI * (3 - sqrt(5.0)) + turn;
+  return center + u_axis * (distance * cos(angle)) + v_axis * (distance * sin(angle));
+}
+
+/**
+ * Whether sample k of `count` is one of the AREA_LIGHT_PROBES probes: the samples in
+ * the middle of as many rings of equal area.
+ */
+bool is_light_probe(int k, int count) {
+  for(int j = 0; j < AREA_LIGHT_PROBES; j++) {
+    if(k == (2 * j + 1) * count / (2 * AREA_LIGHT_PROBES)) return true;
   }
-  vector_t shadow_vec = vector_t { focus_intersection->point, pos_to_dir(light_pos - focus_intersection->point) };
-  vector<intersection_t> *intersections = ray_intersections(shadow_vec, spheres, ground_plane);
-  if(!intersections->empty()) {
-    while((between(light_pos, focus_intersection->point, intersections->back().point) || intersections->back().point.too_close(focus_intersection->point)) && !intersections->empty()) {
-      intersections->pop_back();
+  return false;
+}
+
+/**
+ * Visibility of a spherical area light for the given pixels. Every pixel first sends
+ * AREA_LIGHT_PROBES shadow rays to samples spread over the light; where they all agree
+ * the pixel is taken as fully lit or fully shadowed, and only where they do not, in
+ * the penumbra, does it send the rest of its `light_samples`. The spiral of samples is
+ * turned from pixel to pixel, so what noise remains does not band.
+ */
+traversal_stats_t area_light_visibility(const gbuffer_t &gbuffer, const input_data_t &input_data, light_cache_t *light, const vector<int> &pixels) {
+  int count = input_data.light_samples;
+  traversal_stats_t stats;
+  auto end_point = [](const ray_queue_t &queue) {
+    return [&queue](int r) {
+      return queue.origin(r) + position_t { queue.direction_x[r], queue.direction_y[r], queue.direction_z[r] };
+    };
+  };
+  auto queue_samples = [&](ray_queue_t *queue, int i, bool probes) {
+    double turn = 2 * M_PI * fmod(i * 0.6180339887498949, 1.0);
+    for(int k = 0; k < count; k++) {
+      if(is_light_probe(k, count) != probes) continue;
+      position_t sample = area_light_sample(gbuffer.point(i), light->position, input_data.light_radius, k, count, turn);
+      queue->push(i, vector_t { gbuffer.point(i), pos_to_dir(sample - gbuffer.point(i)) });
     }
+  };
+
+  /* Probes first, counting the lit ones in the pixel's visibility */
+  ray_queue_t probes;
+  for(int i : pixels) {
+    light->visibility[i] = 0;
+    queue_samples(&probes, i, true);
   }
-  if(intersections->empty()) {
-    double illumination = focus_intersection->normal_vector.angle_cos_with(pos_to_dir(light_pos - focus_intersection->point));
-    focus_intersection->color.illuminate(illumination);
+  if(input_data.shadow_ray_order == RAY_ORDER_MORTON) sort_ray_queue(&probes);
+  vector<unsigned char> blocked = trace_shadow_rays(input_data, probes, end_point(probes));
+  for(int r = 0; r < probes.size(); r++) light->visibility[probes.pixel[r]] += !blocked[r];
+  stats.add(probes.stats);
+
+  /* The rest of the samples in the penumbra */
+  ray_queue_t penumbra;
+  vector<int> penumbra_pixels;
+  for(int i : pixels) {
+    if(light->visibility[i] == AREA_LIGHT_PROBES) {
+      light->visibility[i] = 1;
+    } else if(light->visibility[i] > 0) {
+      penumbra_pixels.push_back(i);
+      queue_samples(&penumbra, i, false);
+    }
   }
-  if(DEBUG) cout << "-----------------------------------------------" << endl;
+  if(input_data.shadow_ray_order == RAY_ORDER_MORTON) sort_ray_queue(&penumbra);
+  blocked = trace_shadow_rays(input_data, penumbra, end_point(penumbra));
+  for(int r = 0; r < penumbra.size(); r++) light->visibility[penumbra.pixel[r]] += !blocked[r];
+  stats.add(penumbra.stats);
+  for(int i : penumbra_pixels) light->visibility[i] /= count;
+  return stats;
 }
 
 /**
- * Shoots the given ray vector considering the spheres list.
+ * Visibility of one light for the given G-buffer pixels. Pixels on the ground plane are
+ * resolved by the shadow mask where possible; only the rest are queued as shadow rays,
+ * sorted if asked for.
  */
-color_t shoot_ray(vector_t ray_vec, vector<sphere_t> spheres, vector<position_t> light_positions, plane_t ground_plane) {
-  vector<intersection_t> *intersections = ray_intersections(ray_vec, spheres, ground_plane);
-  if(intersections->empty()) {
-    return white_color;
-  } else {
-    intersection_t elem = intersections->back();
+traversal_stats_t light_visibility(const gbuffer_t &gbuffer, const input_data_t &input_data, light_cache_t *light, const vector<int> &pixels) {
+  position_t light_pos = light->position;
+  ray_queue_t shadow_queue;
+  for(int i : pixels) {
+    int primitive_id = gbuffer.primitive_id[i];
+    mask_state state = MASK_EDGE;
+    if(primitive_id == NO_PRIMITIVE) {
+      state = MASK_SHADOWED;
+    } else if(primitive_id == GROUND_PLANE_ID) {
+      state = light->shadow_mask.lookup(gbuffer.point(i));
+    }
+    light->visibility[i] = state == MASK_LIT;
+    if(state == MASK_EDGE) shadow_queue.push(i, vector_t { gbuffer.point(i), pos_to_dir(light_pos - gbuffer.point(i)) });
+  }
+  if(input_data.light_radius > 0) return area_light_visibility(gbuffer, input_data, light, shadow_queue.pixel);
+  if(input_data.shadow_ray_order == RAY_ORDER_MORTON) sort_ray_queue(&shadow_queue);
+  trace_shadow_queue(input_data, shadow_queue, light);
+  return shadow_queue.stats;
+}
+
+/**
+ * Diffuse contribution of one light for the given G-buffer pixels: what
+ * `color_t::illuminate` would add for every pixel the light is visible from.
+ */
+void shade_pixels(const gbuffer_t &gbuffer, light_cache_t *light, const vector<int> &pixels) {
+  position_t light_pos = light->position;
+  for(int i : pixels) {
+    direction_t to_light = direction_t {
+      light_pos.x - gbuffer.point_x[i],
+      light_pos.y - gbuffer.point_y[i],
+      light_pos.z - gbuffer.point_z[i]
+    };
+    double amount = light->visibility[i] > 0 ? light->visibility[i] * gbuffer.normal(i).angle_cos_with(to_light) : 0.0;
+    light->contribution[i] = max(0.0, amount);
+  }
+}
 
-    while(elem.point == origin && !intersections->empty()) {
-      intersections->pop_back();
-      intersection_t elem = intersections->back();
+/**
+ * Visibility and diffuse contribution of one light for the given G-buffer pixels.
+ */
+traversal_stats_t light_pixels(const gbuffer_t &gbuffer, const input_data_t &input_data, light_cache_t *light, const vector<int> &pixels) {
+  traversal_stats_t stats = light_visibility(gbuffer, input_data, light, pixels);
+  shade_pixels(gbuffer, light, pixels);
+  return stats;
+}
+
+/**
+ * Lights the listed pixels in runs of consecutive ones on the thread pool, the way
+ * `trace_pixels` traces them. The runs touch disjoint pixels of the light's arrays.
+ */
+void light_pixels_in_runs(const gbuffer_t &gbuffer, const input_data_t &input_data, light_cache_t *light, const vector<int> &pixels) {
+  vector<traversal_stats_t> run_stats(tile_runs());
+  parallel_chunks(0, pixels.size(), tile_runs(), [&](int run, int begin, int end) {
+    run_stats[run] = light_pixels(gbuffer, input_data, light, vector<int>(pixels.begin() + begin, pixels.begin() + end));
+  });
+  for(const traversal_stats_t & run : run_stats) light->shadow_stats.add(run);
+}
+
+void light_tiles(const gbuffer_t &gbuffer, const input_data_t &input_data, light_cache_t *light, const vector<tile_t> &tiles) {
+  light_pixels_in_runs(gbuffer, input_data, light, tile_pixels(tiles, gbuffer.height));
+}
+
+/**
+ * A light with the given shadow mask and nothing lit yet.
+ */
+light_cache_t make_light_cache(const gbuffer_t &gbuffer, position_t light_pos, shadow_mask_t shadow_mask) {
+  return light_cache_t { light_pos, move(shadow_mask), vector<float>(gbuffer.size()), vector<double>(gbuffer.size()) };
+}
+
+/**
+ * Second pass of the deferred renderer for a single light: its shadow mask, then
+ * shadow rays and shading over the whole G-buffer.
+ */
+light_cache_t light_pass(const gbuffer_t &gbuffer, const input_data_t &input_data, position_t light_pos) {
+  light_cache_t light = make_light_cache(gbuffer, light_pos, build_shadow_mask(input_data, light_pos, { gbuffer.camera }));
+  light_tiles(gbuffer, input_data, &light, render_tiles(input_data, gbuffer.width, gbuffer.height));
+  return light;
+}
+
+/**
+ * Brings the cached lights in line with `input_data.light_positions`. Lights whose
+ * position did not change keep their cached results; only new or moved lights are
+ * run through the lighting pass. Returns how many lights were recomputed.
+ */
+int relight(render_cache_t *cache, const input_data_t &input_data) {
+  vector<light_cache_t> lights;
+  vector<bool> reused(cache->lights.size(), false);
+  int recomputed = 0;
+  for(position_t light_pos : input_data.light_positions) {
+    int cached = -1;
+    for(int j = 0; j < (int) cache->lights.size() && cached == -1; j++) {
+      if(!reused[j] && cache->lights[j].position == light_pos) cached = j;
     }
-    if(intersections->empty()) return white_color;
-    intersection_t closest_intersection = intersections->back();
-    for(const position_t& light_pos : light_positions) {
-      illuminate_point(&closest_intersection, spheres, ground_plane, light_pos);
+    if(cached != -1) {
+      reused[cached] = true;
+      lights.push_back(move(cache->lights[cached]));
+    } else {
+      lights.push_back(light_pass(cache->gbuffer, input_data, light_pos));
+      recomputed++;
+    }
+  }
+  cache->lights = move(lights);
+  return recomputed;
+}
+
+/**
+ * Sums the cached light contributions of the G-buffer pixel on top of its primitive's
+ * ambient lustre.
+ */
+color_t resolved_color(const render_cache_t &cache, const input_data_t &input_data, int i) {
+  color_t color = primitive_color(input_data, cache.gbuffer.primitive_id[i]);
+  double lustre = color.lustre;
+  for(const light_cache_t & light : cache.lights) {
+    lustre += light.contribution[i];
+  }
+  color.lustre = min(1.0, lustre);
+  return color;
+}
+
+/**
+ * Writes the lit colors of the tile into the plane.
+ */
+void resolve_tile(const render_cache_t &cache, const input_data_t &input_data, color_t **plane, tile_t tile) {
+  for(int x = tile.x_start; x < tile.x_end; x++) {
+    for(int y = tile.y_start; y < tile.y_end; y++) {
+      plane[x][y] = resolved_color(cache, input_data, x * cache.gbuffer.height + y);
     }
-    return closest_intersection.color;
   }
 }
 
+void resolve_lighting(const render_cache_t &cache, const input_data_t &input_data, color_t **plane) {
+  parallel_tiles(render_tiles(input_data, cache.gbuffer.width, cache.gbuffer.height), [&](int run, const vector<tile_t> &run_tiles) {
+    for(tile_t tile : run_tiles) resolve_tile(cache, input_data, plane, tile);
+  });
+}
+
 color_t apply_illumination(color_t color) {
   return color_t { (int) (color.R * color.lustre + 0.5)
                  , (int) (color.G * color.lustre + 0.5)
@@ -202,40 +503,924 @@ color_t apply_illumination(color_t color) {
 }
 
 /**
- * Writes the given plane `plane` as a bmp image into a file named `filename`.
+ * Whether two neighbouring pixels of the one sample frame lie on an edge: on different
+ * primitives, or lit so differently that a channel differs by more than
+ * AA_COLOR_THRESHOLD.
  */
-void write_image(color_t **plane, string filename) {
-  bitmap_image image(100 * RESOLUTION_COEFF, 100 * RESOLUTION_COEFF);
-  forall_plane(plane, [plane, &image](double x, double y) {
-    color_t color =
-      apply_illumination(
-        plane
-          [(int) ((x - PLANE_START_X) * RESOLUTION_COEFF)]
-          [(int) ((y - PLANE_START_Y) * RESOLUTION_COEFF)]
-      );
-    image.set_pixel((x-PLANE_START_X) * RESOLUTION_COEFF, (y-PLANE_START_Y) * RESOLUTION_COEFF, color.R, color.G, color.B);
-    return color;
+bool is_edge(const gbuffer_t &gbuffer, color_t **plane, int x1, int y1, int x2, int y2) {
+  if(gbuffer.primitive_id[x1 * gbuffer.height + y1] != gbuffer.primitive_id[x2 * gbuffer.height + y2]) return true;
+  color_t a = apply_illumination(plane[x1][y1]), b = apply_illumination(plane[x2][y2]);
+  return abs(a.R - b.R) > AA_COLOR_THRESHOLD || abs(a.G - b.G) > AA_COLOR_THRESHOLD || abs(a.B - b.B) > AA_COLOR_THRESHOLD;
+}
+
+/**
+ * Pixels on either side of an edge of the one sample frame, in the render order of
+ * their tiles.
+ */
+vector<int> edge_pixels(const render_cache_t &cache, const input_data_t &input_data, color_t **plane) {
+  const gbuffer_t &gbuffer = cache.gbuffer;
+  vector<unsigned char> edge(gbuffer.size(), false);
+  for(int x = 0; x < gbuffer.width; x++) {
+    for(int y = 0; y < gbuffer.height; y++) {
+      int i = x * gbuffer.height + y;
+      if(x + 1 < gbuffer.width && is_edge(gbuffer, plane, x, y, x + 1, y)) {
+        edge[i] = true;
+        edge[i + gbuffer.height] = true;
+      }
+      if(y + 1 < gbuffer.height && is_edge(gbuffer, plane, x, y, x, y + 1)) {
+        edge[i] = true;
+        edge[i + 1] = true;
+      }
+    }
+  }
+  vector<int> pixels;
+  for(int i : tile_pixels(render_tiles(input_data, gbuffer.width, gbuffer.height), gbuffer.height)) {
+    if(edge[i]) pixels.push_back(i);
+  }
+  return pixels;
+}
+
+/**
+ * Lit colors of the hits of a G-buffer of samples, every cached light's visibility and
+ * contribution summed on the primitive's ambient lustre the way the render passes do
+ * it for pixels.
+ */
+vector<color_t> light_samples(const render_cache_t &cache, const input_data_t &input_data, const gbuffer_t &samples) {
+  int count = samples.size();
+  vector<int> indexes(count);
+  for(int i = 0; i < count; i++) indexes[i] = i;
+  vector<color_t> colors(count);
+  for(int i = 0; i < count; i++) colors[i] = primitive_color(input_data, samples.primitive_id[i]);
+  for(const light_cache_t & light : cache.lights) {
+    light_cache_t sample_light = make_light_cache(samples, light.position, light.shadow_mask);
+    light_pixels(samples, input_data, &sample_light, indexes);
+    for(int i = 0; i < count; i++) colors[i].lustre += sample_light.contribution[i];
+  }
+  for(color_t & color : colors) color = apply_illumination(color_t { color.R, color.G, color.B, min(1.0, color.lustre) });
+  return colors;
+}
+
+/**
+ * Counters of the reflection passes: rays traced, and chains that ended on a mirror
+ * because what it would add fell below REFLECTION_MIN_WEIGHT (`pruned`) or the pixel
+ * had used up its reflection rays (`cut`).
+ */
+struct reflection_stats_t {
+  long long rays = 0;
+  long long pruned = 0;
+  long long cut = 0;
+
+  void add(const reflection_stats_t &other) {
+    this->rays += other.rays;
+    this->pruned += other.pruned;
+    this->cut += other.cut;
+  }
+};
+
+/**
+ * Blends mirror reflections into lit colors. colors[j] is the lit color of hit
+ * `hits[j]` of the G-buffer, found by a ray going along incoming(j). A hit on a mirror
+ * of reflectivity k keeps 1 - k of its own color and takes k of what its reflection
+ * ray finds, which may be a mirror again: every pixel follows a chain of reflection
+ * rays, traced bounce by bounce for all chains together through the same batched
+ * queries as primary rays, and lit like them. A chain ends on a mirror, which then
+ * keeps all of its remaining share, once that share times k falls below
+ * REFLECTION_MIN_WEIGHT or `reflection_rays` rays were traced for it.
+ */
+template <typename direction_of>
+void add_reflections(const render_cache_t &cache, const input_data_t &input_data, const gbuffer_t &hits, const vector<int> &hit_indexes,
+                     direction_of incoming, vector<color_t> *colors, reflection_stats_t *stats) {
+  int count = hit_indexes.size();
+  vector<double> red(count), green(count), blue(count);
+  /* The chains still going: the color each adds to, its share of it, its hit and ray */
+  vector<int> target(count), at = hit_indexes;
+  vector<double> weight(count, 1.0);
+  vector<position_t> direction(count);
+  for(int j = 0; j < count; j++) {
+    target[j] = j;
+    direction_t d = incoming(j);
+    direction[j] = position_t { d.x, d.y, d.z };
+  }
+  vector<color_t> local = *colors;
+  const gbuffer_t *current = &hits;
+  gbuffer_t bounce;
+  for(int rays = 0; !target.empty(); rays++) {
+    ray_queue_t queue;
+    vector<int> next_target;
+    vector<double> next_weight;
+    for(int j = 0; j < (int) target.size(); j++) {
+      int i = at[j];
+      double k = reflectivity(input_data, current->primitive_id[i]);
+      bool prune = k > 0 && weight[j] * k < REFLECTION_MIN_WEIGHT;
+      bool cut = k > 0 && !prune && rays >= input_data.reflection_rays;
+      bool reflect = k > 0 && !prune && !cut;
+      double keep = reflect ? weight[j] * (1 - k) : weight[j];
+      red[target[j]] += keep * local[j].R;
+      green[target[j]] += keep * local[j].G;
+      blue[target[j]] += keep * local[j].B;
+      stats->pruned += prune;
+      stats->cut += cut;
+      if(!reflect) continue;
+      position_t normal = normalized(position_t { current->normal_x[i], current->normal_y[i], current->normal_z[i] });
+      position_t mirrored = direction[j] - normal * (2 * dot(direction[j], normal));
+      queue.push(queue.size(), vector_t { current->point(i), pos_to_dir(mirrored) });
+      next_target.push_back(target[j]);
+      next_weight.push_back(weight[j] * k);
+    }
+    if(queue.size() == 0) break;
+    stats->rays += queue.size();
+    bounce = make_gbuffer(queue.size(), 1);
+    trace_queue(&bounce, input_data, queue);
+    local = light_samples(cache, input_data, bounce);
+    current = &bounce;
+    target = move(next_target);
+    weight = move(next_weight);
+    at.resize(queue.size());
+    direction.resize(queue.size());
+    for(int r = 0; r < queue.size(); r++) {
+      at[r] = r;
+      direction[r] = position_t { queue.direction_x[r], queue.direction_y[r], queue.direction_z[r] };
+    }
+  }
+  for(int j = 0; j < count; j++) {
+    (*colors)[j] = color_t { (int) (red[j] + 0.5), (int) (green[j] + 0.5), (int) (blue[j] + 0.5), 1.0 };
+  }
+}
+
+/**
+ * Shades the queued sample rays the way the render passes shade pixels: closest hits,
+ * lit by every cached light, with their reflections. The rays' pixel indexes must
+ * number them from 0 in queue order. Returns the lit colors, in that order.
+ */
+vector<color_t> shade_samples(const render_cache_t &cache, const input_data_t &input_data, const ray_queue_t &queue) {
+  int count = queue.size();
+  gbuffer_t samples = make_gbuffer(count, 1);
+  trace_queue(&samples, input_data, queue);
+  vector<color_t> colors = light_samples(cache, input_data, samples);
+  if(has_reflections(input_data)) {
+    vector<int> indexes(count);
+    for(int i = 0; i < count; i++) indexes[i] = i;
+    reflection_stats_t stats;
+    add_reflections(cache, input_data, samples, indexes, [&](int j) { return queue.ray(j).direction; }, &colors, &stats);
+  }
+  return colors;
+}
+
+/**
+ * Adds the reflections of the mirrors in the resolved frame to it. Reflecting pixels
+ * are taken in render order and split into runs for the thread pool; they end up
+ * fully lit with their blended color, the way supersampled pixels do.
+ */
+reflection_stats_t reflect(const render_cache_t &cache, const input_data_t &input_data, color_t **plane) {
+  const gbuffer_t &gbuffer = cache.gbuffer;
+  int height = gbuffer.height;
+  vector<int> pixels;
+  for(int i : tile_pixels(render_tiles(input_data, gbuffer.width, height), height)) {
+    if(reflectivity(input_data, gbuffer.primitive_id[i]) > 0) pixels.push_back(i);
+  }
+  vector<reflection_stats_t> run_stats(tile_runs());
+  parallel_chunks(0, pixels.size(), tile_runs(), [&](int run, int begin, int end) {
+    vector<int> hit_indexes(pixels.begin() + begin, pixels.begin() + end);
+    vector<color_t> colors(end - begin);
+    for(int j = 0; j < end - begin; j++) colors[j] = apply_illumination(plane[hit_indexes[j] / height][hit_indexes[j] % height]);
+    add_reflections(cache, input_data, gbuffer, hit_indexes, [&](int j) {
+      return primary_ray(gbuffer.camera, hit_indexes[j] / height, hit_indexes[j] % height).direction;
+    }, &colors, &run_stats[run]);
+    for(int j = 0; j < end - begin; j++) plane[hit_indexes[j] / height][hit_indexes[j] % height] = colors[j];
+  });
+  reflection_stats_t stats;
+  for(const reflection_stats_t & run : run_stats) stats.add(run);
+  return stats;
+}
+
+/**
+ * Reflects the resolved frame and reports how many rays that took.
+ */
+void reflect_frame(const render_cache_t &cache, const input_data_t &input_data, color_t **plane) {
+  if(!has_reflections(input_data)) return;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  reflection_stats_t stats = reflect(cache, input_data, plane);
+  double time = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+  cout << "Traced " << stats.rays << " reflection rays in " << time << " ms; " << stats.pruned << " chains pruned as too faint, "
+       << stats.cut << " cut at " << input_data.reflection_rays << " rays" << endl;
+}
+
+/**
+ * Adaptive anti-aliasing of the resolved frame in `plane`. Only the pixels `edge_pixels`
+ * finds get more samples: a grid of `antialias_side` squared samples over the pixel,
+ * whose corner sample is the one the frame already has. Their lit colors are averaged
+ * into the pixel, which is then stored as fully lit. Returns how many pixels were
+ * supersampled.
+ */
+int antialias(const render_cache_t &cache, const input_data_t &input_data, color_t **plane, int side) {
+  if(side <= 1) return 0;
+  int height = cache.gbuffer.height;
+  vector<int> pixels = edge_pixels(cache, input_data, plane);
+  parallel_chunks(0, pixels.size(), tile_runs(), [&](int run, int begin, int end) {
+    ray_queue_t queue;
+    for(int p = begin; p < end; p++) {
+      int x = pixels[p] / height, y = pixels[p] % height;
+      for(int s = 1; s < side * side; s++) {
+        queue.push(queue.size(), primary_ray(cache.gbuffer.camera, x + (double) (s / side) / side, y + (double) (s % side) / side));
+      }
+    }
+    vector<color_t> colors = shade_samples(cache, input_data, queue);
+    for(int p = begin; p < end; p++) {
+      int x = pixels[p] / height, y = pixels[p] % height;
+      color_t corner = apply_illumination(plane[x][y]);
+      int R = corner.R, G = corner.G, B = corner.B;
+      for(int s = 1; s < side * side; s++) {
+        color_t color = colors[(p - begin) * (side * side - 1) + s - 1];
+        R += color.R;
+        G += color.G;
+        B += color.B;
+      }
+      int samples = side * side;
+      plane[x][y] = color_t { (R + samples / 2) / samples, (G + samples / 2) / samples, (B + samples / 2) / samples, 1.0 };
+    }
   });
+  return pixels.size();
+}
+
+/**
+ * Anti-aliases the resolved frame and reports how much of it needed supersampling and
+ * how long that took.
+ */
+void antialias_frame(const render_cache_t &cache, const input_data_t &input_data, color_t **plane) {
+  if(input_data.antialias_side <= 1) return;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  int pixels = antialias(cache, input_data, plane, input_data.antialias_side);
+  double time = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+  int side = input_data.antialias_side;
+  cout << "Supersampled " << pixels << " edge pixels (" << 100.0 * pixels / cache.gbuffer.size() << "% of the frame) with "
+       << (long long) pixels * (side * side - 1) << " more rays in " << time << " ms" << endl;
+}
+
+/**
+ * Pixels of the tile a progressive pass samples: those on the grid of the pass's stride
+ * that no coarser pass has sampled. Tiles start on multiples of TILE_SIZE, so every
+ * block of a pass lies within a single tile.
+ */
+vector<int> tile_pass_pixels(tile_t tile, int height, int stride) {
+  vector<int> pixels;
+  for(int x = tile.x_start; x < tile.x_end; x++) {
+    for(int y = tile.y_start; y < tile.y_end; y++) {
+      bool on_grid = x % stride == 0 && y % stride == 0;
+      bool sampled = stride < PROGRESSIVE_FIRST_STRIDE && x % (2 * stride) == 0 && y % (2 * stride) == 0;
+      if(on_grid && !sampled) pixels.push_back(x * height + y);
+    }
+  }
+  return pixels;
+}
+
+/**
+ * Pixels a progressive pass samples over the whole frame, in render order.
+ */
+vector<int> progressive_pixels(const vector<tile_t> &tiles, int height, int stride) {
+  vector<int> pixels;
+  for(tile_t tile : tiles) {
+    vector<int> tile_part = tile_pass_pixels(tile, height, stride);
+    pixels.insert(pixels.end(), tile_part.begin(), tile_part.end());
+  }
+  return pixels;
+}
+
+/**
+ * Fills the plane with the samples taken so far, every pixel of tiles[t] getting the
+ * lit color of the sample at the corner of its strides[t] x strides[t] block. At stride
+ * 1 this is `resolve_lighting`.
+ */
+void resolve_preview(const render_cache_t &cache, const input_data_t &input_data, color_t **plane,
+                     const vector<tile_t> &tiles, const vector<int> &strides) {
+  int height = cache.gbuffer.height;
+  parallel_chunks(0, tiles.size(), tile_runs(), [&](int run, int begin, int end) {
+    for(int t = begin; t < end; t++) {
+      int stride = strides[t];
+      for(int x = tiles[t].x_start; x < tiles[t].x_end; x++) {
+        for(int y = tiles[t].y_start; y < tiles[t].y_end; y++) {
+          plane[x][y] = resolved_color(cache, input_data, (x - x % stride) * height + y - y % stride);
+        }
+      }
+    }
+  });
+}
+
+/**
+ * Renders the frame into an empty cache in passes of growing resolution: first one
+ * sample per PROGRESSIVE_FIRST_STRIDE squared block of pixels, then every pass halves
+ * the stride and only traces and lights the pixels the earlier passes did not, so the
+ * last pass leaves the same cache as a full render. After every pass the plane holds
+ * the preview and on_pass(stride) is called. Returns how the primary rays of all
+ * passes went through the scene.
+ *
+ * Building a shadow mask takes about as long as tracing a shadow ray for every pixel,
+ * so the coarse passes go without one and trace the plane pixels' shadow rays, which
+ * the mask only spares; the masks are built for the last pass, which holds three
+ * quarters of the pixels.
+ */
+template <typename action>
+traversal_stats_t render_progressive(render_cache_t *cache, const input_data_t &input_data, color_t **plane, action on_pass) {
+  gbuffer_t &gbuffer = cache->gbuffer;
+  cache->lights.clear();
+  for(position_t light_pos : input_data.light_positions) {
+    cache->lights.push_back(make_light_cache(gbuffer, light_pos, shadow_mask_t { false }));
+  }
+  vector<tile_t> tiles = render_tiles(input_data, gbuffer.width, gbuffer.height);
+  traversal_stats_t stats;
+  for(int stride = PROGRESSIVE_FIRST_STRIDE; stride >= 1; stride /= 2) {
+    if(stride == 1) {
+      for(light_cache_t & light : cache->lights) light.shadow_mask = build_shadow_mask(input_data, light.position, { gbuffer.camera });
+    }
+    vector<int> pixels = progressive_pixels(tiles, gbuffer.height, stride);
+    stats.add(trace_pixels(&gbuffer, input_data, pixels));
+    for(light_cache_t & light : cache->lights) {
+      light_pixels_in_runs(gbuffer, input_data, &light, pixels);
+    }
+    resolve_preview(*cache, input_data, plane, tiles, vector<int>(tiles.size(), stride));
+    on_pass(stride);
+  }
+  return stats;
+}
+
+/**
+ * Gives every listed pixel of a progressive pass at `stride` that hit the same
+ * primitive as the coarser sample at the corner of its 2 * stride block that sample's
+ * visibility of the light. Returns the pixels that still need a shadow ray of their own.
+ */
+vector<int> share_visibility(const gbuffer_t &gbuffer, light_cache_t *light, const vector<int> &pixels, int stride) {
+  int height = gbuffer.height;
+  vector<int> own;
+  for(int i : pixels) {
+    int x = i / height, y = i % height;
+    int corner = (x - x % (2 * stride)) * height + y - y % (2 * stride);
+    if(gbuffer.primitive_id[i] == gbuffer.primitive_id[corner]) {
+      light->visibility[i] = light->visibility[corner];
+    } else {
+      own.push_back(i);
+    }
+  }
+  return own;
+}
+
+/**
+ * What refining one tile by one progressive pass did and how long it took. `lit` counts
+ * the pixels that had their visibility worked out for a light, summed over the lights.
+ */
+struct tile_pass_t {
+  int pixels = 0;
+  int lit = 0;
+  double trace_ms = 0;
+  double light_ms = 0;
+  traversal_stats_t primary_stats;
+  vector<traversal_stats_t> shadow_stats;
+};
+
+/**
+ * Traces and lights the pixels a progressive pass at `stride` samples in the tile,
+ * timing both. With `share_shadows`, pixels take the visibility of their coarser
+ * sample where `share_visibility` allows it. Runs on the calling thread: the budgeted
+ * render refines tiles side by side on the pool.
+ */
+tile_pass_t refine_tile(render_cache_t *cache, const input_data_t &input_data, tile_t tile, int stride, bool share_shadows) {
+  gbuffer_t &gbuffer = cache->gbuffer;
+  tile_pass_t pass;
+  vector<int> pixels = tile_pass_pixels(tile, gbuffer.height, stride);
+  pass.pixels = pixels.size();
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  ray_queue_t queue;
+  queue_primary_rays(&queue, gbuffer, pixels, 0, pixels.size());
+  trace_queue(&gbuffer, input_data, queue);
+  pass.primary_stats = queue.stats;
+  chrono::steady_clock::time_point traced = chrono::steady_clock::now();
+  for(light_cache_t & light : cache->lights) {
+    vector<int> own = share_shadows ? share_visibility(gbuffer, &light, pixels, stride) : pixels;
+    pass.shadow_stats.push_back(light_visibility(gbuffer, input_data, &light, own));
+    shade_pixels(gbuffer, &light, pixels);
+    pass.lit += own.size();
+  }
+  pass.trace_ms = chrono::duration<double, milli>(traced - start).count();
+  pass.light_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - traced).count();
+  return pass;
+}
+
+/**
+ * Quality a budgeted render settled for: the stride every tile was refined down to, in
+ * render order, how many pixel-light pairs had their visibility worked out and how
+ * many shared that of a coarser sample, and whether reflections and what supersampling
+ * fit.
+ */
+struct budget_report_t {
+  vector<int> tile_strides;
+  long long lit = 0;
+  long long shared = 0;
+  int antialias_side = 1;
+  int antialias_pixels = 0;
+  bool reflections = false;
+  double time = 0;
+};
+
+/**
+ * Renders the frame into an empty cache within `budget` milliseconds of wall clock.
+ * The frame is refined like `render_progressive` does, but tile by tile: the first
+ * pass always runs, after which every tile goes down one stride per pass if the time
+ * it took per pixel in its last pass says the new pixels fit in what is left of the
+ * budget. If they only fit with fewer shadow rays, the new pixels share the visibility
+ * of their coarser samples; if not even then, the tile keeps its stride. Tiles are
+ * taken in render order, so with the center-out order the middle of the frame is
+ * refined first. Once every tile reached full resolution, what remains after the last
+ * pass goes to reflections if all their rays would fit, then to the largest
+ * supersampling grid up to the one asked for whose estimated cost fits. The time to
+ * resolve the frame is measured after the first pass and kept aside. Shadow masks are
+ * never built: building one is a fixed cost up front, which pays off only in a frame
+ * that reaches full resolution.
+ */
+budget_report_t render_within_budget(render_cache_t *cache, const input_data_t &input_data, color_t **plane, double budget,
+                                     traversal_stats_t *stats) {
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  auto elapsed = [&]() { return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count(); };
+  gbuffer_t &gbuffer = cache->gbuffer;
+  cache->lights.clear();
+  for(position_t light_pos : input_data.light_positions) {
+    cache->lights.push_back(make_light_cache(gbuffer, light_pos, shadow_mask_t { false }));
+  }
+  vector<tile_t> tiles = render_tiles(input_data, gbuffer.width, gbuffer.height);
+  budget_report_t report;
+  report.tile_strides.assign(tiles.size(), 2 * PROGRESSIVE_FIRST_STRIDE);
+  /* Per tile, from its last pass: ms per pixel traced, and per pixel-light pair lit */
+  vector<double> trace_cost(tiles.size()), light_cost(tiles.size());
+  long long sampled = 0;
+  double sampled_ms = 0;
+  /* Pixel-light pairs of the tiles that shared shadows, and how many of them still had to trace */
+  long long sharing_pairs = 0, sharing_lit = 0;
+  double reserve = 0;
+  int workers = thread_pool().size();
+  int light_count = cache->lights.size();
+
+  for(int stride = PROGRESSIVE_FIRST_STRIDE; stride >= 1; stride /= 2) {
+    /* Tiles refined side by side, whether they share shadows, and the wall time they should take */
+    vector<int> group;
+    vector<bool> share;
+    double group_ms = 0;
+    auto run_group = [&]() {
+      vector<tile_pass_t> passes(group.size());
+      parallel_chunks(0, group.size(), group.size(), [&](int chunk, int begin, int end) {
+        passes[chunk] = refine_tile(cache, input_data, tiles[group[chunk]], stride, share[chunk]);
+      });
+      for(int g = 0; g < (int) group.size(); g++) {
+        const tile_pass_t &pass = passes[g];
+        int t = group[g];
+        report.tile_strides[t] = stride;
+        report.lit += pass.lit;
+        report.shared += (long long) pass.pixels * light_count - pass.lit;
+        stats->add(pass.primary_stats);
+        for(int l = 0; l < light_count; l++) cache->lights[l].shadow_stats.add(pass.shadow_stats[l]);
+        if(pass.pixels > 0) trace_cost[t] = pass.trace_ms / pass.pixels;
+        if(pass.lit > 0) light_cost[t] = pass.light_ms / pass.lit;
+        if(share[g]) {
+          sharing_pairs += (long long) pass.pixels * light_count;
+          sharing_lit += pass.lit;
+        }
+        sampled += pass.pixels;
+        sampled_ms += pass.trace_ms + pass.light_ms;
+      }
+      group.clear();
+      share.clear();
+      group_ms = 0;
+    };
+    /* Three quarters of a block are new in every pass after the first */
+    auto new_pixels = [&](int t) {
+      return 3 * (long long) (tiles[t].x_end - tiles[t].x_start) * (tiles[t].y_end - tiles[t].y_start) / (4.0 * stride * stride);
+    };
+    /* Until a tile has shared, about half the pixels are guessed to still need their own rays */
+    double own_share = sharing_pairs > 0 ? (double) sharing_lit / sharing_pairs : 0.5;
+    auto estimate = [&](int t, bool share_shadows) {
+      return new_pixels(t) * (trace_cost[t] + light_count * light_cost[t] * (share_shadows ? own_share : 1.0));
+    };
+    /* The pass shares shadows unless all of it fits without */
+    bool share_shadows = false;
+    if(stride < PROGRESSIVE_FIRST_STRIDE) {
+      double pass_ms = 0;
+      for(int t = 0; t < (int) tiles.size(); t++) {
+        if(report.tile_strides[t] == 2 * stride) pass_ms += estimate(t, false);
+      }
+      share_shadows = pass_ms / workers > budget - reserve - elapsed();
+    }
+    for(int t = 0; t < (int) tiles.size(); t++) {
+      if(report.tile_strides[t] != 2 * stride) continue;
+      double tile_ms = stride < PROGRESSIVE_FIRST_STRIDE ? estimate(t, share_shadows) : 0;
+      if(tile_ms > 0 && max(group_ms, tile_ms) > budget - reserve - elapsed()) continue;
+      group.push_back(t);
+      share.push_back(share_shadows);
+      group_ms = max(group_ms, tile_ms);
+      if((int) group.size() == workers) run_group();
+    }
+    if(!group.empty()) run_group();
+    if(stride == PROGRESSIVE_FIRST_STRIDE) {
+      double resolve_start = elapsed();
+      resolve_preview(*cache, input_data, plane, tiles, report.tile_strides);
+      /* Twice what it took, the time to resolve varies that much from one frame to the next */
+      reserve = 2 * (elapsed() - resolve_start);
+    }
+  }
+  resolve_preview(*cache, input_data, plane, tiles, report.tile_strides);
+
+  bool full_resolution = count(report.tile_strides.begin(), report.tile_strides.end(), 1) == (int) tiles.size();
+  /* A sample or reflection ray costs about what a pixel did, and they are shared among the workers */
+  double sample_ms = sampled > 0 ? sampled_ms / sampled / workers : 0;
+  if(has_reflections(input_data) && full_resolution) {
+    long long mirrors = 0;
+    for(int id : gbuffer.primitive_id) mirrors += reflectivity(input_data, id) > 0;
+    /* Every chain may run until its pixel's budget */
+    if(mirrors * input_data.reflection_rays * sample_ms <= budget - elapsed()) {
+      reflect(*cache, input_data, plane);
+      report.reflections = true;
+    }
+  }
+  if(input_data.antialias_side > 1 && full_resolution && sampled > 0) {
+    long long edges = edge_pixels(*cache, input_data, plane).size();
+    int side = input_data.antialias_side;
+    /* Samples on mirrors trace their reflections too */
+    double rays_per_sample = has_reflections(input_data) ? 1 + input_data.reflection_rays : 1;
+    while(side > 1 && edges * (side * side - 1) * rays_per_sample * sample_ms > budget - elapsed()) side--;
+    report.antialias_side = side;
+    report.antialias_pixels = antialias(*cache, input_data, plane, side);
+  }
+  report.time = elapsed();
+  return report;
+}
+
+/**
+ * Prints the quality a budgeted render reached.
+ */
+void print_budget_report(const budget_report_t &report, const input_data_t &input_data, double budget) {
+  cout << "Rendered in " << report.time << " ms of a " << budget << " ms budget:";
+  for(int stride = 1; stride <= PROGRESSIVE_FIRST_STRIDE; stride *= 2) {
+    int tiles = count(report.tile_strides.begin(), report.tile_strides.end(), stride);
+    if(tiles > 0) cout << " 1/" << stride << " resolution on " << tiles << " tiles,";
+  }
+  long long pairs = report.lit + report.shared;
+  cout << " own shadow visibility for " << (pairs == 0 ? 100.0 : 100.0 * report.lit / pairs) << "% of the samples";
+  if(input_data.antialias_side > 1 && report.antialias_side > 1) {
+    cout << ", " << report.antialias_side << "x" << report.antialias_side << " supersampling (" << input_data.antialias_side << "x"
+         << input_data.antialias_side << " asked for) on " << report.antialias_pixels << " edge pixels";
+  } else if(input_data.antialias_side > 1) {
+    cout << ", no time left for supersampling";
+  }
+  if(has_reflections(input_data)) cout << (report.reflections ? ", reflections" : ", no time left for reflections");
+  cout << endl;
+}
+
+/**
+ * Replaces the sphere at `sphere_index` and patches the previous frame in `plane`.
+ * Only the tiles the scene diff marks as dirty are re-traced and re-lit, and only the
+ * cells of the shadow masks under the old and the new shadow of the sphere are
+ * classified anew. Returns the number of tiles that were redone.
+ */
+int rerender_sphere_edit(render_cache_t *cache, input_data_t *input_data, int sphere_index, sphere_t new_sphere, color_t **plane) {
+  sphere_t old_sphere = input_data->spheres[sphere_index];
+  input_data->spheres[sphere_index] = new_sphere;
+  update_acceleration(input_data);
+
+  vector<tile_t> tiles = frame_tiles(cache->gbuffer.width, cache->gbuffer.height);
+  vector<int> dirty = dirty_tiles(tiles, sphere_edit_regions(*input_data, cache->gbuffer.camera, old_sphere, new_sphere));
+  vector<tile_t> dirty_rects;
+  for(int t : dirty) dirty_rects.push_back(tiles[t]);
+  dirty_rects = order_tiles(dirty_rects, input_data->tile_order);
+  trace_tiles(&cache->gbuffer, *input_data, dirty_rects);
+  for(light_cache_t & light : cache->lights) {
+    update_shadow_mask(&light.shadow_mask, *input_data, light.position, old_sphere, new_sphere);
+    light_tiles(cache->gbuffer, *input_data, &light, dirty_rects);
+  }
+  parallel_tiles(dirty_rects, [&](int run, const vector<tile_t> &run_tiles) {
+    for(tile_t tile : run_tiles) resolve_tile(*cache, *input_data, plane, tile);
+  });
+  return dirty.size();
+}
+
+/**
+ * A tile of one of the views `render_views` renders together.
+ */
+struct view_tile_t {
+  int view;
+  tile_t tile;
+};
+
+/**
+ * Renders the scene from every camera in a single job, into one render cache and one
+ * plane per view, with the lights of every view at the positions `light_positions`
+ * gives it. The acceleration structures are the scene's, built once for all views,
+ * and the shadow mask of a light is built once for every place it is at, over the
+ * ground plane all the cameras that see it from there see. The tiles of all views are
+ * laid end to end and split into runs for the thread pool like the tiles of one frame,
+ * so the views share the threads instead of taking turns; a run goes through the
+ * wavefront stages once for every view it reaches. Returns how the primary rays of all
+ * views went through the scene.
+ */
+traversal_stats_t render_views(vector<render_cache_t> *caches, const input_data_t &input_data, const vector<camera_t> &cameras,
+                               const vector<vector<position_t>> &light_positions, const vector<color_t**> &planes) {
+  int views = cameras.size();
+  vector<position_t> mask_positions;
+  vector<vector<camera_t>> mask_cameras;
+  vector<vector<int>> view_masks(views);
+  for(int view = 0; view < views; view++) {
+    for(position_t light_pos : light_positions[view]) {
+      int m = 0;
+      while(m < (int) mask_positions.size() && !(mask_positions[m] == light_pos)) m++;
+      if(m == (int) mask_positions.size()) {
+        mask_positions.push_back(light_pos);
+        mask_cameras.push_back(vector<camera_t>());
+      }
+      mask_cameras[m].push_back(cameras[view]);
+      view_masks[view].push_back(m);
+    }
+  }
+  vector<shadow_mask_t> masks;
+  for(int m = 0; m < (int) mask_positions.size(); m++) masks.push_back(build_shadow_mask(input_data, mask_positions[m], mask_cameras[m]));
+  caches->clear();
+  vector<view_tile_t> jobs;
+  vector<int> first_light(views + 1, 0);
+  for(int view = 0; view < views; view++) {
+    render_cache_t cache = render_cache_t { make_gbuffer(IMAGE_WIDTH, IMAGE_HEIGHT, cameras[view]) };
+    for(int l = 0; l < (int) light_positions[view].size(); l++) {
+      cache.lights.push_back(make_light_cache(cache.gbuffer, light_positions[view][l], masks[view_masks[view][l]]));
+    }
+    first_light[view + 1] = first_light[view] + light_positions[view].size();
+    for(tile_t tile : render_tiles(input_data, cache.gbuffer.width, cache.gbuffer.height)) jobs.push_back(view_tile_t { view, tile });
+    caches->push_back(move(cache));
+  }
+
+  vector<traversal_stats_t> primary_stats(tile_runs());
+  vector<vector<traversal_stats_t>> shadow_stats(tile_runs(), vector<traversal_stats_t>(first_light[views]));
+  parallel_chunks(0, jobs.size(), tile_runs(), [&](int run, int begin, int end) {
+    for(int first = begin, last; first < end; first = last) {
+      int view = jobs[first].view;
+      vector<tile_t> tiles;
+      for(last = first; last < end && jobs[last].view == view; last++) tiles.push_back(jobs[last].tile);
+      render_cache_t &cache = (*caches)[view];
+      vector<int> pixels = tile_pixels(tiles, cache.gbuffer.height);
+      ray_queue_t queue;
+      queue_primary_rays(&queue, cache.gbuffer, pixels, 0, pixels.size());
+      trace_queue(&cache.gbuffer, input_data, queue);
+      primary_stats[run].add(queue.stats);
+      for(int l = 0; l < (int) cache.lights.size(); l++) {
+        shadow_stats[run][first_light[view] + l].add(light_pixels(cache.gbuffer, input_data, &cache.lights[l], pixels));
+      }
+      for(tile_t tile : tiles) resolve_tile(cache, input_data, planes[view], tile);
+    }
+  });
+
+  traversal_stats_t stats;
+  for(int run = 0; run < tile_runs(); run++) {
+    stats.add(primary_stats[run]);
+    for(int view = 0; view < views; view++) {
+      vector<light_cache_t> &lights = (*caches)[view].lights;
+      for(int l = 0; l < (int) lights.size(); l++) lights[l].shadow_stats.add(shadow_stats[run][first_light[view] + l]);
+    }
+  }
+  return stats;
+}
+
+/**
+ * Renders the frames of a sequence, SEQUENCE_BATCH_FRAMES at a time, with
+ * `render_views`: the frames of a batch share the scene and the thread pool, so the
+ * tiles of small frames keep every thread busy, and a light that stays put is masked
+ * once for the whole batch. A frame that moves instances starts a batch of its own,
+ * since the frames of a batch see the same instances; the moves go into the scene and
+ * only the top level is rebuilt, the geometry they place staying as loaded. Calls
+ * on_batch(first, caches, planes, primary_stats, time) once the frames from `first`
+ * on are resolved, with their caches and planes in order and how long the batch took.
+ */
+template <typename action>
+void render_sequence(input_data_t *input_data, const vector<sequence_frame_t> &frames, action on_batch) {
+  vector<color_t**> planes;
+  for(int first = 0, last; first < (int) frames.size(); first = last) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for(const instance_move_t & move : frames[first].moves) {
+      instance_t &instance = input_data->instances[move.instance];
+      make_instance(instance.kind, instance.geometry, move.to_world, &instance);
+    }
+    if(!frames[first].moves.empty()) build_instances(input_data);
+    vector<camera_t> cameras;
+    vector<vector<position_t>> light_positions;
+    for(last = first; last < (int) frames.size() && last - first < SEQUENCE_BATCH_FRAMES; last++) {
+      if(last > first && !frames[last].moves.empty()) break;
+      cameras.push_back(frames[last].camera);
+      light_positions.push_back(frames[last].light_positions);
+    }
+    while(planes.size() < cameras.size()) planes.push_back(init_plane());
+    vector<render_cache_t> caches;
+    traversal_stats_t primary_stats = render_views(&caches, *input_data, cameras, light_positions, planes);
+    double time = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    on_batch(first, caches, planes, primary_stats, time);
+  }
+}
+
+/**
+ * Whether the ground plane lies between the eye and a point off it, where it would
+ * hide the point.
+ */
+bool plane_in_front(const input_data_t &input_data, position_t eye, position_t point) {
+  plane_t plane = input_data.ground_plane;
+  position_t normal = plane.normal_vector.approximate();
+  return dot(point - plane.point, normal) * dot(eye - plane.point, normal) < 0;
+}
+
+/**
+ * Fills the G-buffer of a new camera with the hits of the previous frame that pass the
+ * checks, and returns the pixels left to trace, in render order. A pixel takes the
+ * reprojected hit that landed on it when its primary ray meets the same primitive
+ * within REPROJECTION_DEPTH_TOLERANCE of the hit's distance, the region of every other
+ * sphere and instance the ray may meet lies farther from the eye (see
+ * `occluder_regions`), and the ground plane does not lie between them. Nothing else can
+ * then be in front of the hit the ray finds on the primitive, which is what is stored,
+ * so every pixel holds the hit tracing would give it. `sources` gets the previous
+ * G-buffer index every pixel took its hit from, or -1.
+ */
+vector<int> reuse_reprojected_hits(gbuffer_t *gbuffer, const input_data_t &input_data, const gbuffer_t &previous, vector<int> *sources) {
+  int width = gbuffer->width, height = gbuffer->height;
+  reprojection_t reprojection = reproject(previous, gbuffer->camera);
+  /* The two nearest regions over every pixel, so the hit's own sphere can be skipped */
+  vector<double> nearest(gbuffer->size(), INFINITY), second(gbuffer->size(), INFINITY);
+  vector<int> nearest_id(gbuffer->size(), NO_PRIMITIVE);
+  for(occluder_region_t region : occluder_regions(input_data, gbuffer->camera)) {
+    bool sphere = region.primitive_id != NO_PRIMITIVE;
+    for(int x = region.rect.x_start; x <= region.rect.x_end; x++) {
+      for(int y = region.rect.y_start; y <= region.rect.y_end; y++) {
+        int i = x * height + y;
+        if(sphere && !ray_may_meet_sphere(primary_ray(gbuffer->camera, x, y), input_data.spheres[region.primitive_id])) continue;
+        if(region.distance < nearest[i]) {
+          second[i] = nearest[i];
+          nearest[i] = region.distance;
+          nearest_id[i] = region.primitive_id;
+        } else {
+          second[i] = min(second[i], region.distance);
+        }
+      }
+    }
+  }
+  sources->assign(gbuffer->size(), -1);
+  vector<int> pixels = tile_pixels(render_tiles(input_data, width, height), height);
+  vector<vector<int>> run_pixels(tile_runs());
+  parallel_chunks(0, pixels.size(), tile_runs(), [&](int run, int begin, int end) {
+    for(int p = begin; p < end; p++) {
+      int i = pixels[p], x = i / height, y = i % height;
+      int id = reprojection.primitive_id[i];
+      double occluders = id != NO_PRIMITIVE && nearest_id[i] == id ? second[i] : nearest[i];
+      bool reusable = id != NO_PRIMITIVE && reprojection.distance[i] < occluders;
+      if(reusable) {
+        vector_t ray_vec = primary_ray(gbuffer->camera, x, y);
+        intersection_t closest = intersection_t { white_color, ray_vec.origin, direction_t { 0, 0, 0 } };
+        double distance = INFINITY;
+        reusable = intersect_primitive(input_data, id, ray_vec, [&](const intersection_t &intersection) {
+          keep_closest(ray_vec.origin, intersection, &closest, &distance);
+        });
+        reusable = reusable && distance < occluders
+          && fabs(distance - reprojection.distance[i]) <= REPROJECTION_DEPTH_TOLERANCE * distance
+          && (id == GROUND_PLANE_ID || !plane_in_front(input_data, ray_vec.origin, closest.point));
+        if(reusable) {
+          gbuffer->store(i, closest);
+          (*sources)[i] = reprojection.source[i];
+        }
+      }
+      if(!reusable) run_pixels[run].push_back(i);
+    }
+  });
+  vector<int> traced;
+  for(const vector<int> & run : run_pixels) traced.insert(traced.end(), run.begin(), run.end());
+  return traced;
+}
+
+/**
+ * Gives every listed pixel that took its hit from the previous frame the visibility
+ * of the light its source pixel had there, where every pixel within
+ * REPROJECTION_EDGE_MARGIN of the source lies in the image, hit the same primitive and
+ * saw the light the same way, wholly or not at all. That is a guess, not a proof: a
+ * shadow edge that runs between samples goes unseen, so a pixel here and there can be
+ * lit or shadowed unlike tracing would have it. Returns the pixels that still need a
+ * visibility of their own.
+ */
+vector<int> reuse_visibility(const gbuffer_t &previous, const light_cache_t &previous_light, const vector<int> &sources,
+                             light_cache_t *light, const vector<int> &pixels) {
+  int width = previous.width, height = previous.height, margin = REPROJECTION_EDGE_MARGIN;
+  vector<int> own;
+  for(int i : pixels) {
+    int s = sources[i];
+    float visibility = s == -1 ? 0.5f : previous_light.visibility[s];
+    int x = s / height, y = s % height;
+    bool reusable = (visibility == 0 || visibility == 1) && x >= margin && x < width - margin && y >= margin
+                    && y < height - margin;
+    for(int nx = x - margin; nx <= x + margin && reusable; nx++) {
+      for(int ny = y - margin; ny <= y + margin && reusable; ny++) {
+        int n = nx * height + ny;
+        reusable = previous.primitive_id[n] == previous.primitive_id[s] && previous_light.visibility[n] == visibility;
+      }
+    }
+    if(reusable) {
+      light->visibility[i] = visibility;
+    } else {
+      own.push_back(i);
+    }
+  }
+  return own;
+}
+
+/**
+ * How a frame of a camera path was rendered: how many primary hits and light
+ * visibilities, summed over the lights, it took from the frame before it, how its
+ * primary rays went, and how long tracing, lighting and resolving it took.
+ */
+struct path_frame_t {
+  int reused_hits;
+  int reused_visibility;
+  traversal_stats_t primary_stats;
+  double time;
+};
+
+/**
+ * Renders the cameras of a path one after the other, as the frames of an animation,
+ * into `plane`, and calls on_frame(frame, cache, report) once each frame is resolved.
+ * Only the camera moves, so the shadow mask of every light is built once over all
+ * the cameras, as `render_views` does. With `reuse`, every frame after the first takes
+ * what it can of its primary hits from the frame before it through
+ * `reuse_reprojected_hits` and traces the rest, and with point lights the pixels that
+ * took a hit take what they can of their light visibility through `reuse_visibility`;
+ * the samples of an area light are turned from pixel to pixel, so its visibility is
+ * worked out anew like the shading of every pixel. The hits are the ones tracing would
+ * find, but a reused visibility can be wrong at a stray pixel near a shadow edge.
+ */
+template <typename action>
+void render_camera_path(const input_data_t &input_data, const vector<camera_t> &cameras, bool reuse, color_t **plane, action on_frame) {
+  vector<shadow_mask_t> masks;
+  for(position_t light_pos : input_data.light_positions) masks.push_back(build_shadow_mask(input_data, light_pos, cameras));
+  render_cache_t cache;
+  for(int frame = 0; frame < (int) cameras.size(); frame++) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    gbuffer_t gbuffer = make_gbuffer(IMAGE_WIDTH, IMAGE_HEIGHT, cameras[frame]);
+    vector<int> all = tile_pixels(render_tiles(input_data, gbuffer.width, gbuffer.height), gbuffer.height);
+    vector<int> sources(gbuffer.size(), -1);
+    bool reusing = reuse && frame > 0;
+    vector<int> pixels = reusing ? reuse_reprojected_hits(&gbuffer, input_data, cache.gbuffer, &sources) : all;
+    path_frame_t report = path_frame_t { (int) (all.size() - pixels.size()), 0 };
+    report.primary_stats = trace_pixels(&gbuffer, input_data, pixels);
+
+    render_cache_t previous = move(cache);
+    cache = render_cache_t { move(gbuffer) };
+    for(int l = 0; l < (int) masks.size(); l++) {
+      cache.lights.push_back(make_light_cache(cache.gbuffer, input_data.light_positions[l], masks[l]));
+      light_cache_t &light = cache.lights.back();
+      vector<int> own = reusing && input_data.light_radius == 0
+        ? reuse_visibility(previous.gbuffer, previous.lights[l], sources, &light, all)
+        : all;
+      report.reused_visibility += all.size() - own.size();
+      vector<traversal_stats_t> run_stats(tile_runs());
+      parallel_chunks(0, own.size(), tile_runs(), [&](int run, int begin, int end) {
+        run_stats[run] = light_visibility(cache.gbuffer, input_data, &light, vector<int>(own.begin() + begin, own.begin() + end));
+      });
+      for(const traversal_stats_t & run : run_stats) light.shadow_stats.add(run);
+      parallel_chunks(0, all.size(), tile_runs(), [&](int run, int begin, int end) {
+        shade_pixels(cache.gbuffer, &light, vector<int>(all.begin() + begin, all.begin() + end));
+      });
+    }
+    resolve_lighting(cache, input_data, plane);
+    report.time = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    on_frame(frame, cache, report);
+  }
+}
+
+/**
+ * Writes the given plane `plane` as a bmp image into a file named `filename`. Pixels
+ * are addressed by their integer indexes, the ones `primary_ray` takes: going through
+ * plane coordinates instead rounds some of them down into the previous column or row.
+ * The plane itself is left as it is, so a patched frame can be written again later.
+ */
+void write_image(color_t **plane, string filename) {
+  bitmap_image image(IMAGE_WIDTH, IMAGE_HEIGHT);
+  for(int x = 0; x < IMAGE_WIDTH; x++) {
+    for(int y = 0; y < IMAGE_HEIGHT; y++) {
+      color_t color = apply_illumination(plane[x][y]);
+      image.set_pixel(x, y, color.R, color.G, color.B);
+    }
+  }
   image.save_image(filename);
 }
 
 double read_double(string description) {
   cout << description << ": ";
-  double value;
+  double value = 0;
   cin >> value;
   return value;
 }
 
 int read_int(string description) {
   cout << description << ": ";
-  int value;
+  int value = 0;
   cin >> value;
   return value;
 }
 
 bool read_bool(string description) {
   cout << description << ": ";
-  bool value;
+  bool value = false;
   cin >> value;
   return value;
 }
@@ -257,6 +1442,13 @@ color_t read_color(string description) {
   return color_t { R, G, B, AMBIENT_LIGHT };
 }
 
+sphere_t read_sphere() {
+  color_t color = read_color("Sphere Color");
+  position_t center = read_position("Sphere Center");
+  int radius = read_int("Sphere Radius");
+  return sphere_t { color, center, radius };
+}
+
 /**
  * Reads all the information necessary for representing spheres
  */
@@ -264,10 +1456,7 @@ void read_spheres(vector<sphere_t> *spheres) {
   string object = "Sphere";
   int N = read_int("Number of spheres");
   for(int i = 1; i <= N; i++) {
-    color_t color = read_color("Sphere Color");
-    position_t center = read_position("Sphere Center");
-    int radius = read_int("Sphere Radius");
-    spheres->push_back(sphere_t { color, center, radius });
+    spheres->push_back(read_sphere());
   };
 }
 
@@ -306,19 +1495,314 @@ input_data_t read_input_data() {
   return input_data_t { *spheres, *light_positions, plane_t { position_t { 0, 0, 700 }, direction_t { 0, 0, -1 }, PLANE_COLOR } };
 }
 
-int main() 
+/**
+ * Loads the scene from a binary, PLY or text scene file, reporting how long it took.
+ * Prints the reason and returns false if the file cannot be used.
+ */
+bool load_scene_file(string path, input_data_t *input_data) {
+  chrono::steady_clock::time_point load_start = chrono::steady_clock::now();
+  string error;
+  if(!load_any_scene(path, input_data, &error)) {
+    cout << "Cannot load the scene: " << error << "." << endl;
+    return false;
+  }
+  double load_time = chrono::duration<double, milli>(chrono::steady_clock::now() - load_start).count();
+  cout << "Loaded " << input_data->spheres.size() << " spheres and " << input_data->light_positions.size()
+       << " light sources from " << path << " in " << load_time << " ms" << endl;
+  return true;
+}
+
+/**
+ * Loads a PLY triangle mesh into the scene as it is, as a single instance with the
+ * identity transform, and builds its BVH, reporting how long that took. Prints the
+ * reason and returns false if the file cannot be used.
+ */
+bool load_mesh_file(string path, input_data_t *input_data) {
+  chrono::steady_clock::time_point load_start = chrono::steady_clock::now();
+  string error;
+  mesh_t mesh;
+  if(!load_ply_mesh(path, &mesh, &error)) {
+    cout << "Cannot load the mesh: " << error << "." << endl;
+    return false;
+  }
+  double load_time = chrono::duration<double, milli>(chrono::steady_clock::now() - load_start).count();
+  cout << "Loaded " << mesh.triangle_count() << " triangles from " << path << " and built their BVH in " << load_time
+       << " ms, SAH cost " << mesh.bvh.built_cost << endl;
+  instance_t instance;
+  make_instance(GEOMETRY_MESH, input_data->meshes.size(), identity_transform(), &instance);
+  input_data->meshes.push_back(move(mesh));
+  input_data->instances.push_back(instance);
+  return true;
+}
+
+/**
+ * Loads an instance file into the scene, reporting how much geometry it shares.
+ * Prints the reason and returns false if the file cannot be used.
+ */
+bool load_instances(string path, input_data_t *input_data) {
+  chrono::steady_clock::time_point load_start = chrono::steady_clock::now();
+  int instances = input_data->instances.size();
+  int meshes = input_data->meshes.size(), clusters = input_data->clusters.size();
+  string error;
+  if(!load_instance_file(path, input_data, &error)) {
+    cout << "Cannot load the instances: " << error << "." << endl;
+    return false;
+  }
+  double load_time = chrono::duration<double, milli>(chrono::steady_clock::now() - load_start).count();
+  cout << "Loaded " << input_data->instances.size() - instances << " instances of " << input_data->meshes.size() - meshes
+       << " meshes and " << input_data->clusters.size() - clusters << " sphere clusters from " << path << " in "
+       << load_time << " ms" << endl;
+  return true;
+}
+
+/**
+ * Builds the top level BVH over the instances and reports how long it took, along with
+ * how much geometry the instances stand for against how much is stored.
+ */
+void build_top_level(input_data_t *input_data) {
+  chrono::steady_clock::time_point build_start = chrono::steady_clock::now();
+  build_instances(input_data);
+  double build_time = chrono::duration<double, milli>(chrono::steady_clock::now() - build_start).count();
+  if(input_data->instances.empty()) return;
+  long long stored = 0, placed = 0;
+  for(const mesh_t & mesh : input_data->meshes) stored += mesh.triangle_count();
+  for(const sphere_cluster_t & cluster : input_data->clusters) stored += cluster.spheres.size();
+  for(const instance_t & instance : input_data->instances) {
+    placed += instance.kind == GEOMETRY_MESH
+      ? input_data->meshes[instance.geometry].triangle_count()
+      : input_data->clusters[instance.geometry].spheres.size();
+  }
+  cout << "Built the top level BVH over " << input_data->instances.size() << " instances in " << build_time << " ms, "
+       << placed << " triangles and spheres placed from " << stored << " stored" << endl;
+}
+
+/**
+ * Builds the selected acceleration structure and reports how long it took. With a
+ * `cache_dir`, a BVH built by an earlier run over the same spheres is loaded from it
+ * instead, and a newly built one is stored there; without one nothing is written.
+ */
+void build_acceleration(input_data_t *input_data, const string &cache_dir) {
+  chrono::steady_clock::time_point build_start = chrono::steady_clock::now();
+  if(input_data->acceleration == ACCELERATION_BVH) {
+    bool cached = !cache_dir.empty() && load_cached_bvh(cache_dir, input_data->spheres, &input_data->bvh);
+    if(!cached) input_data->bvh = build_bvh(input_data->spheres);
+    update_sphere_soa(input_data);
+    double build_time = chrono::duration<double, milli>(chrono::steady_clock::now() - build_start).count();
+    cout << (cached ? "Loaded" : "Built") << " the BVH over " << input_data->spheres.size() << " spheres in " << build_time
+         << " ms, SAH cost " << input_data->bvh.built_cost << endl;
+    if(!cached && !cache_dir.empty() && !store_cached_bvh(cache_dir, input_data->spheres, input_data->bvh)) {
+      cout << "Could not write the BVH cache under " << cache_dir << "." << endl;
+    }
+    return;
+  }
+  input_data->grid = build_grid(input_data->spheres, input_data->acceleration == ACCELERATION_TWO_LEVEL_GRID);
+  double build_time = chrono::duration<double, milli>(chrono::steady_clock::now() - build_start).count();
+  const grid_level_t &top = input_data->grid.top;
+  cout << "Built the grid over " << input_data->spheres.size() << " spheres in " << build_time << " ms, "
+       << top.resolution[0] << "x" << top.resolution[1] << "x" << top.resolution[2] << " cells, "
+       << input_data->grid.subgrids.size() << " subgrids" << endl;
+}
+
+/**
+ * Reports how the primary rays went through the scene, run by run in the tile order.
+ */
+void print_primary_stats(const traversal_stats_t &stats, const input_data_t &input_data) {
+  cout << "Traced " << stats.rays << " primary rays in " << stats.batches << " batches, tiles in "
+       << tile_order_names[input_data.tile_order] << " order on " << tile_runs() << " runs: " << stats.node_fetches
+       << " node fetches, " << stats.node_misses << " node cache misses" << endl;
+}
+
+/**
+ * Reports how the shadow rays of all lights went through the scene in their batches.
+ */
+void print_shadow_stats(const render_cache_t &cache, const input_data_t &input_data) {
+  traversal_stats_t stats;
+  for(const light_cache_t & light : cache.lights) stats.add(light.shadow_stats);
+  cout << "Traced " << stats.rays << " shadow rays in " << stats.batches << " batches, "
+       << (input_data.shadow_ray_order == RAY_ORDER_MORTON ? "sorted" : "unsorted") << ": "
+       << stats.node_fetches << " node fetches (" << (stats.batches == 0 ? 0 : stats.node_fetches / stats.batches)
+       << " per batch) for " << stats.node_tests << " ray-node tests, a "
+       << 100 * stats.node_hit_rate() << "% batch hit rate, " << stats.node_misses << " node cache misses" << endl;
+}
+
+int main(int argc, char **argv)
 {
-  input_data_t input_data = read_input_data();
+  render_options_t options = parse_options(argc, argv);
+  input_data_t input_data;
+  if(options.scene_path.empty()) {
+    input_data = read_input_data();
+  } else if(!load_scene_file(options.scene_path, &input_data)) {
+    return 1;
+  }
+  for(string mesh_path : options.mesh_paths) {
+    if(!load_mesh_file(mesh_path, &input_data)) return 1;
+  }
+  for(string instance_path : options.instance_paths) {
+    if(!load_instances(instance_path, &input_data)) return 1;
+  }
+  vector<camera_t> cameras, camera_path;
+  if(!options.views_path.empty()) {
+    string error;
+    if(!load_view_file(options.views_path, &cameras, &error)) {
+      cout << "Cannot load the views: " << error << "." << endl;
+      return 1;
+    }
+  }
+  if(!options.camera_path.empty()) {
+    string error;
+    if(!load_view_file(options.camera_path, &camera_path, &error)) {
+      cout << "Cannot load the camera path: " << error << "." << endl;
+      return 1;
+    }
+  }
+  vector<sequence_frame_t> sequence;
+  if(!options.sequence_path.empty()) {
+    string error;
+    if(!load_sequence_file(options.sequence_path, input_data, &sequence, &error)) {
+      cout << "Cannot load the sequence: " << error << "." << endl;
+      return 1;
+    }
+  }
+  build_top_level(&input_data);
+  input_data.acceleration = options.acceleration;
+  input_data.shadow_ray_order = options.shadow_ray_order;
+  input_data.tile_order = options.tile_order;
+  input_data.antialias_side = options.antialias_side;
+  input_data.light_radius = options.light_radius;
+  input_data.light_samples = options.light_samples;
+  input_data.sphere_reflectivity = options.sphere_reflectivity;
+  input_data.plane_reflectivity = options.plane_reflectivity;
+  input_data.reflection_rays = options.reflection_rays;
+  build_acceleration(&input_data, options.bvh_cache_dir);
 
   cout << "Starting the rendering, this process can take a while..." << endl;
+  /* Views are rendered together, once, and the program ends with them */
+  if(!cameras.empty()) {
+    vector<color_t**> planes;
+    for(int view = 0; view < (int) cameras.size(); view++) planes.push_back(init_plane());
+    vector<render_cache_t> caches;
+    chrono::steady_clock::time_point render_start = chrono::steady_clock::now();
+    vector<vector<position_t>> light_positions(cameras.size(), input_data.light_positions);
+    traversal_stats_t primary_stats = render_views(&caches, input_data, cameras, light_positions, planes);
+    double time = chrono::duration<double, milli>(chrono::steady_clock::now() - render_start).count();
+    cout << "Rendered " << cameras.size() << " views in " << time << " ms" << endl;
+    print_primary_stats(primary_stats, input_data);
+    for(int view = 0; view < (int) cameras.size(); view++) {
+      cout << "View " << view + 1 << ": ";
+      print_shadow_stats(caches[view], input_data);
+      reflect_frame(caches[view], input_data, planes[view]);
+      antialias_frame(caches[view], input_data, planes[view]);
+      write_image(planes[view], "screen_" + to_string(view + 1) + ".bmp");
+    }
+    return 0;
+  }
+
+  /* So are the frames of a camera path, one after the other */
+  if(!camera_path.empty()) {
+    color_t **plane = init_plane();
+    render_camera_path(input_data, camera_path, options.reproject, plane, [&](int frame, const render_cache_t &cache, const path_frame_t &report) {
+      traversal_stats_t shadow_stats;
+      for(const light_cache_t & light : cache.lights) shadow_stats.add(light.shadow_stats);
+      cout << "Frame " << frame + 1 << ": reused " << report.reused_hits << " primary hits and " << report.reused_visibility
+           << " light visibilities, traced " << report.primary_stats.rays << " primary and " << shadow_stats.rays
+           << " shadow rays in " << report.time << " ms" << endl;
+      reflect_frame(cache, input_data, plane);
+      antialias_frame(cache, input_data, plane);
+      write_image(plane, "frame_" + to_string(frame + 1) + ".bmp");
+    });
+    return 0;
+  }
+
+  /* And so are the frames of a sequence, a batch at a time */
+  if(!sequence.empty()) {
+    render_sequence(&input_data, sequence, [&](int first, const vector<render_cache_t> &caches, const vector<color_t**> &planes,
+                                              const traversal_stats_t &primary_stats, double time) {
+      cout << "Rendered frames " << first + 1 << " to " << first + caches.size() << " in " << time << " ms" << endl;
+      print_primary_stats(primary_stats, input_data);
+      for(int view = 0; view < (int) caches.size(); view++) {
+        reflect_frame(caches[view], input_data, planes[view]);
+        antialias_frame(caches[view], input_data, planes[view]);
+        write_image(planes[view], "frame_" + to_string(first + view + 1) + ".bmp");
+      }
+    });
+    return 0;
+  }
+
   /* Preparing the plane */
   color_t **plane = init_plane();
-
-  forall_plane(plane, [input_data](double x, double y){
-    return shoot_ray(vector_t { origin, direction_t { x, y, PLANE_Z } }, input_data.spheres, input_data.light_positions, input_data.ground_plane);
-  });
+  traversal_stats_t primary_stats;
+  render_cache_t cache;
+  if(options.budget > 0) {
+    cache = render_cache_t { make_gbuffer(IMAGE_WIDTH, IMAGE_HEIGHT) };
+    print_budget_report(render_within_budget(&cache, input_data, plane, options.budget, &primary_stats), input_data, options.budget);
+  } else if(options.preview_path.empty()) {
+    cache = render_cache_t { trace_gbuffer(input_data, &primary_stats) };
+    relight(&cache, input_data);
+    resolve_lighting(cache, input_data, plane);
+  } else {
+    /* Every pass is written out at once, so a viewer can show it while the next one runs */
+    chrono::steady_clock::time_point render_start = chrono::steady_clock::now();
+    cache = render_cache_t { make_gbuffer(IMAGE_WIDTH, IMAGE_HEIGHT) };
+    primary_stats = render_progressive(&cache, input_data, plane, [&](int stride) {
+      write_image(plane, options.preview_path);
+      double time = chrono::duration<double, milli>(chrono::steady_clock::now() - render_start).count();
+      cout << "Wrote the 1/" << stride << " resolution preview to " << options.preview_path << " after " << time << " ms" << endl;
+    });
+  }
+  print_primary_stats(primary_stats, input_data);
+  print_shadow_stats(cache, input_data);
+  if(options.budget == 0) {
+    reflect_frame(cache, input_data, plane);
+    antialias_frame(cache, input_data, plane);
+  }
 
   /* Drawing the image */
   write_image(plane, "screen.bmp");
+
+  /* Only the lights that changed are recomputed on re-renders */
+  while(read_bool("Move the light sources and render again? (1 or 0 for yes or no)")) {
+    input_data.light_positions.clear();
+    read_light_positions(&input_data.light_positions);
+    if(options.budget > 0) {
+      /* A budgeted frame holds no full G-buffer to re-light, so it is rendered anew */
+      cache = render_cache_t { make_gbuffer(IMAGE_WIDTH, IMAGE_HEIGHT) };
+      print_budget_report(render_within_budget(&cache, input_data, plane, options.budget, &primary_stats), input_data, options.budget);
+      write_image(plane, "screen.bmp");
+      continue;
+    }
+    int recomputed = relight(&cache, input_data);
+    cout << "Recomputed " << recomputed << " of " << cache.lights.size() << " light sources." << endl;
+    resolve_lighting(cache, input_data, plane);
+    reflect_frame(cache, input_data, plane);
+    antialias_frame(cache, input_data, plane);
+    write_image(plane, "screen.bmp");
+  }
+
+  /* Only the tiles a sphere edit can reach are re-traced */
+  while(read_bool("Edit a sphere and render again? (1 or 0 for yes or no)")) {
+    int sphere_index = read_int("Sphere number (starting from 1)") - 1;
+    if(sphere_index < 0 || sphere_index >= (int) input_data.spheres.size()) {
+      cout << "There is no such sphere." << endl;
+      continue;
+    }
+    if(options.budget > 0) {
+      input_data.spheres[sphere_index] = read_sphere();
+      update_acceleration(&input_data);
+      cache = render_cache_t { make_gbuffer(IMAGE_WIDTH, IMAGE_HEIGHT) };
+      print_budget_report(render_within_budget(&cache, input_data, plane, options.budget, &primary_stats), input_data, options.budget);
+      write_image(plane, "screen.bmp");
+      continue;
+    }
+    int redone = rerender_sphere_edit(&cache, &input_data, sphere_index, read_sphere(), plane);
+    cout << "Re-rendered " << redone << " of " << frame_tiles(IMAGE_WIDTH, IMAGE_HEIGHT).size() << " tiles." << endl;
+    if(input_data.antialias_side > 1 || has_reflections(input_data)) {
+      /* Supersampled pixels no longer hold their corner sample, so edges are found anew,
+         and the sphere may show up in any mirror */
+      resolve_lighting(cache, input_data, plane);
+      reflect_frame(cache, input_data, plane);
+      antialias_frame(cache, input_data, plane);
+    }
+    write_image(plane, "screen.bmp");
+  }
   return 0;
 }
@@ -1,9 +1,13 @@
+#pragma once
+
 #define PLANE_START_X -50
 #define PLANE_END_X 50
 #define PLANE_START_Y -50
 #define PLANE_END_Y 50
 #define PLANE_WIDTH (PLANE_END_X - PLANE_START_X)
 #define PLANE_HEIGHT (PLANE_END_Y - PLANE_START_Y)
+#define IMAGE_WIDTH (PLANE_WIDTH * RESOLUTION_COEFF)
+#define IMAGE_HEIGHT (PLANE_HEIGHT * RESOLUTION_COEFF)
 #define PLANE_Z 100.0 // Assuming this is constant since it eases up things
 #define DEBUG 0
 #define LIGHT_POS { 500, 500, 500 }
@@ -12,6 +16,12 @@
 #define WHITE_COLOR color_t { 255, 255, 255, 0 }
 #define PLANE_COLOR color_t { 255, 255, 255, AMBIENT_LIGHT }
 #define EPSILON 0.00001
+#define AA_COLOR_THRESHOLD 16 // Neighbours differing by more than this in a channel get supersampled
+#define AREA_LIGHT_PROBES 4 // Shadow rays every pixel sends to an area light before deciding it is in penumbra
+#define AREA_LIGHT_SAMPLES 16 // Shadow rays a penumbra pixel gets in all, unless --light-samples says otherwise
+#define REFLECTION_RAY_BUDGET 4 // Reflection rays a pixel may trace, unless --reflect-rays says otherwise
+#define REFLECTION_MIN_WEIGHT (1.0 / 255) // Below this share of a pixel a reflection cannot change its color
+#define PROGRESSIVE_FIRST_STRIDE 8 // A progressive render first samples one pixel in 8 x 8
 
 using namespace std;
 
@@ -52,8 +62,26 @@ struct position_t {
   bool too_close(position_t other) {
     return pow(this->x - other.x, 2) + pow(this->y - other.y, 2) + pow(this->z - other.z, 2) <= CLOSENESS_TOLERANCE;
   }
+  position_t operator*(double coeff) {
+    return position_t { coeff * this->x, coeff * this->y, coeff * this->z };
+  }
 };
 
+/**
+ * Dot and cross products of positions treated as vectors.
+ */
+double dot(position_t a, position_t b) {
+  return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+position_t cross(position_t a, position_t b) {
+  return position_t { a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x };
+}
+
+position_t normalized(position_t a) {
+  return a * (1.0 / a.length());
+}
+
 /**
  * Representation of a RGB color.
  */
@@ -107,10 +135,10 @@ struct direction_t {
   double length() {
     return sqrt(this->x * this->x + this->y * this->y + this->z * this->z); 
   }
-  int dot(direction_t other) {
+  double dot(direction_t other) {
     return this->x * other.x + this->y * other.y + this->z * other.z;
   }
-  int dot(position_t other) {
+  double dot(position_t other) {
     return this->x * other.x + this->y * other.y + this->z * other.z;
   }
   direction_t operator*(double coeff) {
@@ -134,12 +162,6 @@ struct plane_t {
   color_t color;
 };
 
-struct input_data_t {
-  vector<sphere_t> spheres;
-  vector<position_t> light_positions;
-  plane_t ground_plane;
-};
-
 /**
  * Vectors have origin and direction. This represents the formula (origin + t * direction).
  */
@@ -148,6 +170,14 @@ struct vector_t {
   direction_t direction;
 };
 
+/**
+ * Primitive ids stored in intersections. Spheres use their index in the sphere list,
+ * mesh triangles and cluster spheres follow them (see `assign_primitive_ids`); the
+ * ground plane and "nothing was hit" get these sentinels.
+ */
+#define NO_PRIMITIVE -1
+#define GROUND_PLANE_ID -2
+
 /**
  * Intersection is modeled as a color and a point. Color is the color of the object
  * which point is on.
@@ -156,6 +186,7 @@ struct intersection_t {
   color_t color;
   position_t point;
   direction_t normal_vector;
+  int primitive_id = NO_PRIMITIVE;
 };
 
 direction_t sphere_normal_vector(sphere_t sphere, position_t pos) {
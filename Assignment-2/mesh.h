@@ -0,0 +1,187 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <math.h>
+#include "main.h"
+#include "bvh.h"
+
+/* Assignment-3's getAsArray returns a local array; nothing here calls it */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wreturn-local-addr"
+#include "../Assignment-3/GeometricDefinitions.h"
+#pragma GCC diagnostic pop
+
+/**
+ * Triangle mesh, as Assignment-3's Object3D loads it: Vertex records with colors
+ * in [0, 1], and faces given by vertex indexes. Faces are split into triangles whose
+ * three vertex indexes are kept in `triangles`, reordered into the leaf order of the
+ * mesh's BVH, so a leaf covers triangles [first, first + count) and the BVH indices
+ * are the identity.
+ *
+ * For the ray test the corners are also kept as `corners[corner][axis][triangle]`:
+ * one contiguous array per coordinate, which lets a leaf be tested in a straight loop
+ * the compiler can vectorize. Every triangle gets the flat color of its vertex average.
+ * `first_id` is the primitive id of the first triangle.
+ */
+struct mesh_t {
+  string name;
+  vector<Vertex> vertices;
+  vector<int> triangles;
+  vector<float> corners[3][3];
+  vector<color_t> colors;
+  bvh_t bvh;
+  int first_id;
+
+  int triangle_count() const {
+    return this->colors.size();
+  }
+  position_t corner(int triangle, int corner) const {
+    return position_t { this->corners[corner][0][triangle], this->corners[corner][1][triangle], this->corners[corner][2][triangle] };
+  }
+  aabb_t bounds() const {
+    return this->bvh.nodes.empty() ? empty_aabb() : this->bvh.nodes[0].bounds;
+  }
+};
+
+/**
+ * Geometric normal of a triangle, facing the side its vertices wind counterclockwise.
+ */
+position_t triangle_normal(const mesh_t &mesh, int triangle) {
+  position_t a = mesh.corner(triangle, 0);
+  return cross(mesh.corner(triangle, 1) - a, mesh.corner(triangle, 2) - a);
+}
+
+/**
+ * Builds the mesh over the given vertices and triangle vertex indexes (three per
+ * triangle, all valid): the BVH over triangle boxes, then the triangle data in the
+ * BVH's leaf order.
+ */
+mesh_t build_mesh(string name, vector<Vertex> vertices, const vector<int> &triangles) {
+  mesh_t mesh;
+  mesh.name = name;
+  mesh.vertices = move(vertices);
+  int count = triangles.size() / 3;
+
+  vector<bvh_ref_t> refs(count);
+  parallel_chunks(0, count, thread_pool().size(), [&](int chunk, int begin, int end) {
+    for(int t = begin; t < end; t++) {
+      aabb_t bounds = empty_aabb();
+      for(int c = 0; c < 3; c++) {
+        const Vertex &v = mesh.vertices[triangles[3 * t + c]];
+        position_t p = position_t { v.x, v.y, v.z };
+        bounds.extend(aabb_t { p, p });
+      }
+      position_t padding = position_t { BVH_PADDING, BVH_PADDING, BVH_PADDING };
+      bounds = aabb_t { bounds.low - padding, bounds.high + padding };
+      refs[t] = bvh_ref_t { bounds, (bounds.low + bounds.high) * 0.5, t };
+    }
+  });
+  mesh.bvh = build_bvh_over(move(refs));
+
+  mesh.triangles.resize(3 * count);
+  mesh.colors.resize(count);
+  for(int c = 0; c < 3; c++) {
+    for(int axis = 0; axis < 3; axis++) mesh.corners[c][axis].resize(count);
+  }
+  parallel_chunks(0, count, thread_pool().size(), [&](int chunk, int begin, int end) {
+    for(int j = begin; j < end; j++) {
+      int t = mesh.bvh.indices[j];
+      double r = 0, g = 0, b = 0;
+      for(int c = 0; c < 3; c++) {
+        const Vertex &v = mesh.vertices[triangles[3 * t + c]];
+        mesh.triangles[3 * j + c] = triangles[3 * t + c];
+        mesh.corners[c][0][j] = v.x;
+        mesh.corners[c][1][j] = v.y;
+        mesh.corners[c][2][j] = v.z;
+        r += v.r;
+        g += v.g;
+        b += v.b;
+      }
+      mesh.colors[j] = color_t {
+        max(0, min(255, (int) lround(r * 255 / 3))),
+        max(0, min(255, (int) lround(g * 255 / 3))),
+        max(0, min(255, (int) lround(b * 255 / 3))),
+        AMBIENT_LIGHT
+      };
+      mesh.bvh.indices[j] = j;
+    }
+  });
+  return mesh;
+}
+
+/**
+ * Per-ray setup of the watertight ray/triangle test of Woop, Benthin and Wald. The
+ * axes are permuted so that z is the ray's largest direction component, and the
+ * triangle is sheared so the ray runs along +z from the origin; the test is then a 2D
+ * one by edge functions, which give bit-identical results for an edge shared by two
+ * triangles, so rays never slip through a closed mesh between them.
+ */
+struct triangle_ray_t {
+  int kx;
+  int ky;
+  int kz;
+  double sx;
+  double sy;
+  double sz;
+  double ox;
+  double oy;
+  double oz;
+};
+
+triangle_ray_t make_triangle_ray(vector_t ray_vec) {
+  double d[3] = { ray_vec.direction.x, ray_vec.direction.y, ray_vec.direction.z };
+  double o[3] = { ray_vec.origin.x, ray_vec.origin.y, ray_vec.origin.z };
+  int kz = fabs(d[0]) > fabs(d[1]) ? (fabs(d[0]) > fabs(d[2]) ? 0 : 2) : (fabs(d[1]) > fabs(d[2]) ? 1 : 2);
+  int kx = (kz + 1) % 3, ky = (kx + 1) % 3;
+  if(d[kz] < 0) swap(kx, ky); // Keeps the winding, and with it the sign of the normal
+  return triangle_ray_t { kx, ky, kz, d[kx] / d[kz], d[ky] / d[kz], 1.0 / d[kz], o[kx], o[ky], o[kz] };
+}
+
+/**
+ * Tests triangles [first, first + count) of the mesh against the ray, writing the ray
+ * parameter of every hit at t >= 0 into `t`, and INFINITY for the misses. Both sides
+ * of a triangle are hit. The loop has no branches, only selects.
+ */
+void intersect_triangles(const mesh_t &mesh, const triangle_ray_t &ray, int first, int count, double *t) {
+  const float *x[3], *y[3], *z[3];
+  for(int c = 0; c < 3; c++) {
+    x[c] = mesh.corners[c][ray.kx].data() + first;
+    y[c] = mesh.corners[c][ray.ky].data() + first;
+    z[c] = mesh.corners[c][ray.kz].data() + first;
+  }
+  for(int i = 0; i < count; i++) {
+    double az = z[0][i] - ray.oz, bz = z[1][i] - ray.oz, cz = z[2][i] - ray.oz;
+    double ax = x[0][i] - ray.ox - ray.sx * az, ay = y[0][i] - ray.oy - ray.sy * az;
+    double bx = x[1][i] - ray.ox - ray.sx * bz, by = y[1][i] - ray.oy - ray.sy * bz;
+    double cx = x[2][i] - ray.ox - ray.sx * cz, cy = y[2][i] - ray.oy - ray.sy * cz;
+    double u = cx * by - cy * bx;
+    double v = ax * cy - ay * cx;
+    double w = bx * ay - by * ax;
+    double det = u + v + w;
+    double scaled_t = ray.sz * (u * az + v * bz + w * cz);
+    bool inside = (u >= 0 && v >= 0 && w >= 0) || (u <= 0 && v <= 0 && w <= 0);
+    bool ahead = (det > 0 && scaled_t >= 0) || (det < 0 && scaled_t <= 0);
+    t[i] = inside && ahead ? scaled_t / det : INFINITY;
+  }
+}
+
+/**
+ * Calls visit(triangle, t) for every triangle of the mesh the ray hits at t >= 0.
+ */
+template <typename action>
+void intersect_mesh(const mesh_t &mesh, vector_t ray_vec, action visit) {
+  if(ray_vec.direction.x == 0 && ray_vec.direction.y == 0 && ray_vec.direction.z == 0) return;
+  triangle_ray_t ray = make_triangle_ray(ray_vec);
+  traverse_bvh_leaves(mesh.bvh, ray_vec, [&](const bvh_node_t &node) {
+    double t[BVH_MAX_LEAF_SIZE];
+    for(int first = node.first; first < node.first + node.count; first += BVH_MAX_LEAF_SIZE) {
+      int count = min(BVH_MAX_LEAF_SIZE, node.first + node.count - first);
+      intersect_triangles(mesh, ray, first, count, t);
+      for(int i = 0; i < count; i++) {
+        if(t[i] < INFINITY) visit(first + i, t[i]);
+      }
+    }
+  });
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include "scene.h"
+
+/**
+ * Largest grid of samples edge pixels can be supersampled with.
+ */
+#define AA_MAX_SIDE 8
+
+/**
+ * Options given on the command line. Without a scene file the scene is asked for
+ * interactively.
+ */
+struct render_options_t {
+  acceleration_t acceleration;
+  string scene_path;
+  vector<string> mesh_paths;
+  vector<string> instance_paths;
+  ray_order_t shadow_ray_order;
+  tile_order_t tile_order;
+  int antialias_side;
+  string preview_path;
+  double budget;
+  double light_radius;
+  int light_samples;
+  double sphere_reflectivity;
+  double plane_reflectivity;
+  int reflection_rays;
+  string views_path;
+  string camera_path;
+  bool reproject;
+  string sequence_path;
+  string bvh_cache_dir;
+};
+
+void print_usage(const char *program) {
+  cout << "Usage: " << program << " [--accel bvh|grid|grid2] [--scene file] [--mesh file.ply]... [--instances file]..."
+       << " [--shadow-order queued|morton] [--tile-order columns|scanline|morton|hilbert|center]" << endl;
+  cout << "       [--aa N] [--preview file.bmp] [--budget ms]" << endl;
+  cout << "       [--light-radius r] [--light-samples N] [--reflect-spheres k] [--reflect-plane k] [--reflect-rays N]" << endl;
+  cout << "       [--views file] [--camera-path file] [--reproject on|off] [--sequence file] [--bvh-cache dir|off]" << endl;
+  cout << "  --accel  acceleration structure to trace through: a BVH (default), a uniform" << endl;
+  cout << "           grid, or a two-level grid" << endl;
+  cout << "  --bvh-cache  directory to keep built BVHs in and load them from on later runs" << endl;
+  cout << "           over the same spheres; off, the default, builds the BVH every run" << endl;
+  cout << "           and writes nothing" << endl;
+  cout << "  --scene  binary, PLY or text scene file to render instead of asking for the scene" << endl;
+  cout << "  --mesh   PLY triangle mesh to add to the scene, may be given more than once" << endl;
+  cout << "  --instances  file of meshes and sphere clusters placed by transforms (see" << endl;
+  cout << "           instance_file.h), may be given more than once" << endl;
+  cout << "  --shadow-order  trace the shadow rays of a light in the order their pixels were" << endl;
+  cout << "           queued (default), or sorted by direction octant and origin Morton code" << endl;
+  cout << "  --tile-order  order the render passes take the tiles in and hand them to threads:" << endl;
+  cout << "           column by column (default), row by row, along a Morton or Hilbert" << endl;
+  cout << "           curve, or from the center out" << endl;
+  cout << "  --aa     supersample pixels on edges with an N x N grid of samples; 1, the" << endl;
+  cout << "           default, keeps one sample per pixel" << endl;
+  cout << "  --preview  render progressively from 1/" << PROGRESSIVE_FIRST_STRIDE << " resolution up, writing every pass to" << endl;
+  cout << "           the given file as soon as it is done" << endl;
+  cout << "  --budget  render within the given milliseconds, lowering the resolution of tiles," << endl;
+  cout << "           sharing shadow rays and shrinking --aa as the measured tile times ask" << endl;
+  cout << "           for, and report what was reached" << endl;
+  cout << "  --light-radius  make every light a sphere of the given radius, with soft shadows;" << endl;
+  cout << "           0, the default, keeps point lights" << endl;
+  cout << "  --light-samples  shadow rays a pixel in the penumbra of an area light gets, from " << AREA_LIGHT_PROBES << endl;
+  cout << "           up (default " << AREA_LIGHT_SAMPLES << "); the others get " << AREA_LIGHT_PROBES << endl;
+  cout << "  --reflect-spheres, --reflect-plane  share of the light, from 0 (default) to 1, the" << endl;
+  cout << "           spheres or the ground plane mirror" << endl;
+  cout << "  --reflect-rays  reflection rays a pixel may trace at most (default " << REFLECTION_RAY_BUDGET << ")" << endl;
+  cout << "  --views  file of cameras (see view_file.h) to render the scene from in one job," << endl;
+  cout << "           into screen_1.bmp, screen_2.bmp and so on, instead of the single" << endl;
+  cout << "           interactive view; --preview and --budget do not apply to them" << endl;
+  cout << "  --camera-path  file of cameras, in the format of --views, to render one after the" << endl;
+  cout << "           other as an animation into frame_1.bmp, frame_2.bmp and so on" << endl;
+  cout << "  --reproject  take the primary hits of a path frame from the frame before it where" << endl;
+  cout << "           they pass the checks and trace only the rest (on, the default), or" << endl;
+  cout << "           trace every frame in full (off)" << endl;
+  cout << "  --sequence  file of per-frame cameras, light positions and instance transforms" << endl;
+  cout << "           (see sequence_file.h) to render as an animation into frame_1.bmp," << endl;
+  cout << "           frame_2.bmp and so on, several frames to a job over the scene loaded once" << endl;
+}
+
+/**
+ * Parses the command line, printing the usage and exiting on anything it does not
+ * understand.
+ */
+render_options_t parse_options(int argc, char **argv) {
+  render_options_t options = render_options_t { ACCELERATION_BVH, "", vector<string>(), vector<string>(), RAY_ORDER_QUEUED, TILE_ORDER_COLUMNS, 1, "", 0, 0, AREA_LIGHT_SAMPLES, 0, 0, REFLECTION_RAY_BUDGET, "", "", true, "", "" };
+  for(int i = 1; i < argc; i++) {
+    string option = argv[i];
+    string value = i + 1 < argc ? argv[i + 1] : "";
+    int tile_order = 0;
+    while(tile_order <= TILE_ORDER_CENTER && value != tile_order_names[tile_order]) tile_order++;
+    if(option == "--accel" && value == "bvh") {
+      options.acceleration = ACCELERATION_BVH;
+    } else if(option == "--accel" && value == "grid") {
+      options.acceleration = ACCELERATION_GRID;
+    } else if(option == "--accel" && value == "grid2") {
+      options.acceleration = ACCELERATION_TWO_LEVEL_GRID;
+    } else if(option == "--bvh-cache" && value == "off") {
+      options.bvh_cache_dir = "";
+    } else if(option == "--bvh-cache" && !value.empty()) {
+      options.bvh_cache_dir = value;
+    } else if(option == "--scene" && !value.empty()) {
+      options.scene_path = value;
+    } else if(option == "--mesh" && !value.empty()) {
+      options.mesh_paths.push_back(value);
+    } else if(option == "--instances" && !value.empty()) {
+      options.instance_paths.push_back(value);
+    } else if(option == "--shadow-order" && value == "queued") {
+      options.shadow_ray_order = RAY_ORDER_QUEUED;
+    } else if(option == "--shadow-order" && value == "morton") {
+      options.shadow_ray_order = RAY_ORDER_MORTON;
+    } else if(option == "--tile-order" && tile_order <= TILE_ORDER_CENTER) {
+      options.tile_order = (tile_order_t) tile_order;
+    } else if(option == "--aa" && atoi(value.c_str()) >= 1 && atoi(value.c_str()) <= AA_MAX_SIDE) {
+      options.antialias_side = atoi(value.c_str());
+    } else if(option == "--preview" && !value.empty()) {
+      options.preview_path = value;
+    } else if(option == "--budget" && atof(value.c_str()) > 0) {
+      options.budget = atof(value.c_str());
+    } else if(option == "--light-radius" && atof(value.c_str()) >= 0) {
+      options.light_radius = atof(value.c_str());
+    } else if(option == "--light-samples" && atoi(value.c_str()) >= AREA_LIGHT_PROBES) {
+      options.light_samples = atoi(value.c_str());
+    } else if(option == "--reflect-spheres" && atof(value.c_str()) >= 0 && atof(value.c_str()) <= 1) {
+      options.sphere_reflectivity = atof(value.c_str());
+    } else if(option == "--reflect-plane" && atof(value.c_str()) >= 0 && atof(value.c_str()) <= 1) {
+      options.plane_reflectivity = atof(value.c_str());
+    } else if(option == "--reflect-rays" && atoi(value.c_str()) >= 1) {
+      options.reflection_rays = atoi(value.c_str());
+    } else if(option == "--views" && !value.empty()) {
+      options.views_path = value;
+    } else if(option == "--camera-path" && !value.empty()) {
+      options.camera_path = value;
+    } else if(option == "--reproject" && (value == "on" || value == "off")) {
+      options.reproject = value == "on";
+    } else if(option == "--sequence" && !value.empty()) {
+      options.sequence_path = value;
+    } else {
+      print_usage(argv[0]);
+      exit(1);
+    }
+    i++;
+  }
+  return options;
+}
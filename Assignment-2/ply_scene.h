@@ -0,0 +1,290 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "main.h"
+#include "scene.h"
+#include "scene_file.h"
+#include "mesh.h"
+#include "../Assignment-3/ply.h"
+
+/**
+ * Radius of splats whose vertices carry no radius property.
+ */
+#define PLY_DEFAULT_RADIUS 1
+
+/**
+ * One point cloud vertex as the PLY reader stores it. Every property is converted to
+ * double on the way in, whatever its type in the file.
+ */
+struct ply_splat_t {
+  double x;
+  double y;
+  double z;
+  double radius;
+  double r;
+  double g;
+  double b;
+};
+
+/**
+ * Tells whether the file at `path` starts like a PLY file.
+ */
+bool is_ply_scene(const string &path) {
+  char magic[4];
+  FILE *file = fopen(path.c_str(), "rb");
+  if(file == NULL) return false;
+  bool ply = fread(magic, sizeof(magic), 1, file) == 1 && memcmp(magic, "ply", 3) == 0 && (magic[3] == '\n' || magic[3] == '\r');
+  fclose(file);
+  return ply;
+}
+
+/**
+ * Where a vertex property of the given name goes in ply_splat_t, or -1 if it is not
+ * one the loader uses. Colors may be called r/g/b or red/green/blue.
+ */
+int splat_offset(const char *name) {
+  const char *names[] = { "x", "y", "z", "radius", "r", "g", "b", "red", "green", "blue" };
+  int offsets[] = {
+    offsetof(ply_splat_t, x), offsetof(ply_splat_t, y), offsetof(ply_splat_t, z), offsetof(ply_splat_t, radius),
+    offsetof(ply_splat_t, r), offsetof(ply_splat_t, g), offsetof(ply_splat_t, b),
+    offsetof(ply_splat_t, r), offsetof(ply_splat_t, g), offsetof(ply_splat_t, b)
+  };
+  for(int i = 0; i < 10; i++) {
+    if(strcmp(name, names[i]) == 0) return offsets[i];
+  }
+  return -1;
+}
+
+/**
+ * Color channel of a splat: integer properties hold 0-255, floating point ones a
+ * fraction of full intensity, the way Assignment-3's vertex colors do.
+ */
+int splat_channel(double value, bool fraction) {
+  return max(0, min(255, (int) lround(fraction ? value * 255 : value)));
+}
+
+void free_property_list(PlyProperty **properties, int count) {
+  if(properties == NULL) return;
+  for(int j = 0; j < count; j++) {
+    free(properties[j]->name);
+    free(properties[j]);
+  }
+  free(properties);
+}
+
+/**
+ * Opens a PLY file for reading through Assignment-3's reader. Binary files are read
+ * directly by the reader; it does not swap bytes, so only files in the machine's own
+ * byte order are accepted.
+ */
+PlyFile *open_ply(const string &path, int *element_count, char ***element_names, string *error) {
+  if(path.size() < 4 || path.compare(path.size() - 4, 4, ".ply") != 0) {
+    *error = path + " needs the .ply extension to be read as a PLY file";
+    return NULL;
+  }
+  vector<char> name(path.begin(), path.end());
+  name.push_back('\0');
+  int file_type;
+  float version;
+  PlyFile *ply = is_ply_scene(path) ? ply_open_for_reading(name.data(), element_count, element_names, &file_type, &version) : NULL;
+  if(ply == NULL) {
+    *error = "cannot read " + path + " as a PLY file";
+    return NULL;
+  }
+  uint16_t byte_order = 1;
+  int native_type = *((unsigned char*) &byte_order) == 1 ? PLY_BINARY_LE : PLY_BINARY_BE;
+  if(file_type != PLY_ASCII && file_type != native_type) {
+    ply_close(ply);
+    *error = path + " is binary in the other byte order";
+    return NULL;
+  }
+  error->clear();
+  return ply;
+}
+
+/**
+ * Reads and drops all `count` records of an element. Elements are stored one after
+ * another, so those a loader does not use still have to be read past.
+ */
+void skip_ply_element(PlyFile *ply, char *element_name, int count) {
+  ply_get_element_setup(ply, element_name, 0, NULL);
+  ply_splat_t ignored;
+  for(int j = 0; j < count; j++) ply_get_element(ply, &ignored);
+}
+
+/**
+ * Loads a point cloud from the "vertex" element of a PLY file, one sphere per vertex,
+ * through Assignment-3's PLY reader. Vertices need x, y and z; radius defaults to
+ * PLY_DEFAULT_RADIUS and color to white. Radii are rounded to the integral radius of
+ * sphere_t, and to no less than 1. PLY files have no lights, so the scene gets the
+ * single light at LIGHT_POS and the default ground plane.
+ */
+bool load_ply_scene(const string &path, input_data_t *input_data, string *error) {
+  int element_count;
+  char **element_names;
+  PlyFile *ply = open_ply(path, &element_count, &element_names, error);
+  if(ply == NULL) return false;
+
+  vector<sphere_t> spheres;
+  bool found = false;
+  for(int i = 0; i < element_count && !found; i++) {
+    int count, property_count;
+    PlyProperty **properties = ply_get_element_description(ply, element_names[i], &count, &property_count);
+    if(strcmp(element_names[i], "vertex") != 0) {
+      skip_ply_element(ply, element_names[i], count);
+      free_property_list(properties, property_count);
+      continue;
+    }
+
+    found = true;
+    int positions = 0;
+    bool has_radius = false, fraction_colors = false, has_colors = false;
+    for(int j = 0; j < property_count; j++) {
+      int offset = splat_offset(properties[j]->name);
+      if(offset == -1 || properties[j]->is_list) continue;
+      PlyProperty wanted = { properties[j]->name, PLY_DOUBLE, PLY_DOUBLE, offset, 0, 0, 0, 0 };
+      ply_get_property(ply, element_names[i], &wanted);
+      if(offset <= (int) offsetof(ply_splat_t, z)) positions++;
+      if(offset == (int) offsetof(ply_splat_t, radius)) has_radius = true;
+      if(offset >= (int) offsetof(ply_splat_t, r)) {
+        has_colors = true;
+        fraction_colors = properties[j]->external_type == PLY_FLOAT || properties[j]->external_type == PLY_DOUBLE;
+      }
+    }
+    free_property_list(properties, property_count);
+    if(positions < 3) {
+      *error = path + " has vertices without x, y and z";
+      break;
+    }
+
+    spheres.resize(count);
+    for(int j = 0; j < count; j++) {
+      ply_splat_t splat = ply_splat_t { 0, 0, 0, PLY_DEFAULT_RADIUS, 255, 255, 255 };
+      ply_get_element(ply, &splat);
+      bool fraction = has_colors && fraction_colors;
+      spheres[j] = sphere_t {
+        color_t { splat_channel(splat.r, fraction), splat_channel(splat.g, fraction), splat_channel(splat.b, fraction), AMBIENT_LIGHT },
+        position_t { splat.x, splat.y, splat.z },
+        has_radius ? max(1, (int) lround(splat.radius)) : PLY_DEFAULT_RADIUS
+      };
+    }
+  }
+  ply_close(ply);
+  if(error->empty() && !found) *error = path + " has no vertex element";
+  if(!error->empty()) return false;
+
+  input_data->spheres = move(spheres);
+  input_data->light_positions = vector<position_t> { position_t LIGHT_POS };
+  input_data->ground_plane = default_ground_plane();
+  return true;
+}
+
+/**
+ * Where a vertex property of the given name goes in Assignment-3's Vertex, or -1 if it
+ * is not one the mesh loader uses.
+ */
+int vertex_offset(const char *name) {
+  const char *names[] = { "x", "y", "z", "r", "g", "b", "red", "green", "blue" };
+  int offsets[] = {
+    offsetof(Vertex, x), offsetof(Vertex, y), offsetof(Vertex, z),
+    offsetof(Vertex, r), offsetof(Vertex, g), offsetof(Vertex, b),
+    offsetof(Vertex, r), offsetof(Vertex, g), offsetof(Vertex, b)
+  };
+  for(int i = 0; i < 9; i++) {
+    if(strcmp(name, names[i]) == 0) return offsets[i];
+  }
+  return -1;
+}
+
+/**
+ * Loads a triangle mesh the way Assignment-3's Object3D::CreateObject does: vertices
+ * from the "vertex" element, faces from the "vertex_indices" list of the "triangle"
+ * element (or "face", as most exporters call it). Faces with more than three vertices
+ * are split into a fan of triangles. Integer colors are scaled down to [0, 1] like the
+ * floating point ones Assignment-3 uses; vertices without colors are white.
+ */
+bool load_ply_mesh(const string &path, mesh_t *mesh, string *error) {
+  int element_count;
+  char **element_names;
+  PlyFile *ply = open_ply(path, &element_count, &element_names, error);
+  if(ply == NULL) return false;
+
+  vector<Vertex> vertices;
+  vector<int> triangles;
+  bool has_vertices = false, has_faces = false;
+  for(int i = 0; i < element_count && error->empty(); i++) {
+    int count, property_count;
+    PlyProperty **properties = ply_get_element_description(ply, element_names[i], &count, &property_count);
+    bool is_face = strcmp(element_names[i], "triangle") == 0 || strcmp(element_names[i], "face") == 0;
+    if(strcmp(element_names[i], "vertex") == 0 && !has_vertices) {
+      has_vertices = true;
+      int positions = 0;
+      bool has_colors = false, fraction_colors = false;
+      for(int j = 0; j < property_count; j++) {
+        int offset = vertex_offset(properties[j]->name);
+        if(offset == -1 || properties[j]->is_list) continue;
+        PlyProperty wanted = { properties[j]->name, PLY_FLOAT, PLY_FLOAT, offset, 0, 0, 0, 0 };
+        ply_get_property(ply, element_names[i], &wanted);
+        if(offset <= (int) offsetof(Vertex, z)) positions++;
+        if(offset >= (int) offsetof(Vertex, r)) {
+          has_colors = true;
+          fraction_colors = properties[j]->external_type == PLY_FLOAT || properties[j]->external_type == PLY_DOUBLE;
+        }
+      }
+      if(positions < 3) *error = path + " has vertices without x, y and z";
+      float scale = has_colors && !fraction_colors ? 1.0f / 255 : 1.0f;
+      vertices.resize(error->empty() ? count : 0);
+      for(Vertex & vertex : vertices) {
+        vertex = Vertex { 0, 0, 0, 1 / scale, 1 / scale, 1 / scale };
+        ply_get_element(ply, &vertex);
+        vertex.r *= scale;
+        vertex.g *= scale;
+        vertex.b *= scale;
+      }
+    } else if(is_face && !has_faces) {
+      has_faces = true;
+      PlyProperty wanted = {
+        (char*) "vertex_indices", PLY_INT, PLY_INT, offsetof(Triangle, verts),
+        1, PLY_UCHAR, PLY_UCHAR, offsetof(Triangle, nverts)
+      };
+      bool found = false;
+      for(int j = 0; j < property_count && !found; j++) {
+        if(!properties[j]->is_list) continue;
+        if(strcmp(properties[j]->name, "vertex_indices") != 0 && strcmp(properties[j]->name, "vertex_index") != 0) continue;
+        wanted.name = properties[j]->name;
+        ply_get_property(ply, element_names[i], &wanted);
+        found = true;
+      }
+      if(!found) *error = path + " has faces without vertex_indices";
+      for(int j = 0; j < count && found; j++) {
+        Triangle face = Triangle { 0, NULL };
+        ply_get_element(ply, &face);
+        for(int k = 2; k < face.nverts; k++) {
+          triangles.push_back(face.verts[0]);
+          triangles.push_back(face.verts[k - 1]);
+          triangles.push_back(face.verts[k]);
+        }
+        free(face.verts);
+      }
+    } else {
+      skip_ply_element(ply, element_names[i], count);
+    }
+    free_property_list(properties, property_count);
+  }
+  ply_close(ply);
+  if(error->empty() && (!has_vertices || !has_faces)) *error = path + " needs a vertex and a triangle (or face) element";
+  if(error->empty() && triangles.empty()) *error = path + " has no triangles";
+  for(int j = 0; j < (int) triangles.size() && error->empty(); j++) {
+    if(triangles[j] < 0 || triangles[j] >= (int) vertices.size()) *error = path + " has a face with a vertex index out of range";
+  }
+  if(!error->empty()) return false;
+
+  *mesh = build_mesh(path, move(vertices), triangles);
+  return true;
+}
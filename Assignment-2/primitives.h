@@ -0,0 +1,331 @@
+#pragma once
+
+#include <vector>
+#include <tuple>
+#include <math.h>
+#include "main.h"
+#include "scene.h"
+#include "ray_queue.h"
+
+quadratic_result quadratic(double A, double B, double C, double *result1, double *result2) {
+  double discr = B * B - 4 * A * C;
+  if(discr < 0) {
+    // No intersection
+    return NO_ROOT;
+  } else if (discr == 0) {
+    *result1 = -B / (2 * A);
+    return ONE_ROOT;
+  } else {
+    *result1 = (-B - sqrt(discr)) / (2 * A);
+    *result2 = (-B + sqrt(discr)) / (2 * A);
+    return TWO_ROOTS;
+  }
+}
+
+/**
+ * Calls `hit` with every intersection of the ray and the sphere: both roots of the
+ * quadratic when they are in front of the origin, or the single root of a grazing ray.
+ */
+template <typename action>
+void sphere_hits(vector_t ray_vec, sphere_t sphere, int primitive_id, action hit) {
+  double A = ray_vec.direction.dot(ray_vec.direction);
+  double B = 2 * (ray_vec.direction.dot(ray_vec.origin - sphere.center));
+  double C = pow((ray_vec.origin - sphere.center).length(), 2) - pow(sphere.radius, 2);
+  double t1, t2;
+  quadratic_result result = quadratic(A, B, C, &t1, &t2);
+
+  if(result == ONE_ROOT) {
+    position_t point = ray_vec.origin + (ray_vec.direction * t1).approximate();
+    hit(intersection_t { sphere.color, point, sphere_normal_vector(sphere, point), primitive_id });
+  } else if(result == TWO_ROOTS) {
+    position_t point1 = ray_vec.origin + (ray_vec.direction * t1).approximate();
+    position_t point2 = ray_vec.origin + (ray_vec.direction * t2).approximate();
+    if(t1 >= 0) hit(intersection_t { sphere.color, point1, sphere_normal_vector(sphere, point1), primitive_id });
+    if(t2 >= 0) hit(intersection_t { sphere.color, point2, sphere_normal_vector(sphere, point2), primitive_id });
+  }
+}
+
+/**
+ * Marks which spheres [first, first + count) of the SoA arrays the ray may hit. The
+ * discriminant is computed with exactly the operations `sphere_hits` uses, so no hit
+ * is lost, and in a loop without branches over contiguous arrays.
+ */
+void sphere_candidates(const sphere_soa_t &soa, vector_t ray_vec, int first, int count, bool *candidate) {
+  double dx = ray_vec.direction.x, dy = ray_vec.direction.y, dz = ray_vec.direction.z;
+  double ox = ray_vec.origin.x, oy = ray_vec.origin.y, oz = ray_vec.origin.z;
+  double A = dx * dx + dy * dy + dz * dz;
+  const double *x = soa.x.data() + first, *y = soa.y.data() + first, *z = soa.z.data() + first;
+  const double *radius = soa.radius.data() + first;
+  for(int i = 0; i < count; i++) {
+    double ocx = ox - x[i], ocy = oy - y[i], ocz = oz - z[i];
+    double B = 2 * (dx * ocx + dy * ocy + dz * ocz);
+    double length = sqrt(ocx * ocx + ocy * ocy + ocz * ocz);
+    double C = length * length - radius[i] * radius[i];
+    candidate[i] = B * B - 4 * A * C >= 0;
+  }
+}
+
+/**
+ * Batched intersection that runs the single ray `intersect` of a primitive type for
+ * every active queued ray in turn.
+ */
+template <typename primitive, typename predicate, typename action>
+void intersect_each_ray(const input_data_t &input_data, const ray_queue_t &queue, int first, int last, predicate active, action hit) {
+  for(int r = first; r < last; r++) {
+    if(!active(r)) continue;
+    primitive::intersect(input_data, queue.ray(r), [&](const intersection_t &intersection) { hit(r, intersection); });
+  }
+}
+
+/**
+ * Registry of the primitive types the tracer intersects. Every type is a stateless
+ * struct over the arrays `input_data_t` keeps for it, with
+ *
+ *   template <typename action> static void intersect(input_data, ray_vec, hit)
+ *     calling hit(intersection_t) for every intersection in front of the ray origin,
+ *     with its primitive id set, and
+ *   template <typename predicate, typename action>
+ *   static void intersect_queue(input_data, queue, first, last, active, hit)
+ *     the same for the queued rays [first, last) for which active(ray) holds, calling
+ *     hit(ray, intersection); per ray the hits come in the order `intersect` gives, and
+ *     types without a batched traversal use `intersect_each_ray`, and
+ *   static bool color(input_data, primitive_id, color_t *color)
+ *     giving the color of an id of this type, or false for ids of other types, and
+ *   template <typename action> static bool intersect_id(input_data, primitive_id, ray_vec, hit)
+ *     the same as `intersect` for the primitive of the id alone, or false for ids of
+ *     other types and ids the type cannot trace on their own.
+ *
+ * Queries run over `primitive_types_t` with a fold, so every call is resolved at compile
+ * time and inlined: no virtual calls, and a new type only needs to be added to the
+ * tuple.
+ */
+struct sphere_primitives_t {
+  /**
+   * Through the BVH, whole leaves are prefiltered on the SoA copy of the spheres first
+   * and only the candidates get the exact test; the grids visit spheres one by one.
+   */
+  template <typename action>
+  static void intersect(const input_data_t &input_data, vector_t ray_vec, action hit) {
+    const sphere_soa_t &soa = input_data.sphere_soa;
+    if(input_data.acceleration != ACCELERATION_BVH || soa.x.size() != input_data.spheres.size()) {
+      traverse_scene(input_data, ray_vec, [&](int i) { sphere_hits(ray_vec, input_data.spheres[i], i, hit); });
+      return;
+    }
+    traverse_bvh_leaves(input_data.bvh, ray_vec, [&](const bvh_node_t &node) {
+      bool candidate[BVH_MAX_LEAF_SIZE];
+      for(int first = node.first; first < node.first + node.count; first += BVH_MAX_LEAF_SIZE) {
+        int count = min(BVH_MAX_LEAF_SIZE, node.first + node.count - first);
+        sphere_candidates(soa, ray_vec, first, count, candidate);
+        for(int i = 0; i < count; i++) {
+          if(!candidate[i]) continue;
+          int index = input_data.bvh.indices[first + i];
+          sphere_hits(ray_vec, input_data.spheres[index], index, hit);
+        }
+      }
+    });
+  }
+  /**
+   * The rays of a batch go through the BVH together, and every leaf they reach is
+   * prefiltered and tested for all of them while its spheres are in cache.
+   */
+  template <typename predicate, typename action>
+  static void intersect_queue(const input_data_t &input_data, const ray_queue_t &queue, int first, int last, predicate active, action hit) {
+    const sphere_soa_t &soa = input_data.sphere_soa;
+    if(input_data.acceleration != ACCELERATION_BVH || soa.x.size() != input_data.spheres.size()) {
+      intersect_each_ray<sphere_primitives_t>(input_data, queue, first, last, active, hit);
+      return;
+    }
+    traverse_bvh_stream(input_data.bvh, queue, first, last, active, [&](const bvh_node_t &node, const int *rays, int count) {
+      bool candidate[BVH_MAX_LEAF_SIZE];
+      for(int k = 0; k < count; k++) {
+        int r = rays[k];
+        vector_t ray_vec = queue.ray(r);
+        for(int chunk = node.first; chunk < node.first + node.count; chunk += BVH_MAX_LEAF_SIZE) {
+          int chunk_size = min(BVH_MAX_LEAF_SIZE, node.first + node.count - chunk);
+          sphere_candidates(soa, ray_vec, chunk, chunk_size, candidate);
+          for(int i = 0; i < chunk_size; i++) {
+            if(!candidate[i]) continue;
+            int index = input_data.bvh.indices[chunk + i];
+            sphere_hits(ray_vec, input_data.spheres[index], index, [&](const intersection_t &intersection) { hit(r, intersection); });
+          }
+        }
+      }
+    });
+  }
+  static bool color(const input_data_t &input_data, int primitive_id, color_t *color) {
+    if(primitive_id < 0 || primitive_id >= (int) input_data.spheres.size()) return false;
+    *color = input_data.spheres[primitive_id].color;
+    return true;
+  }
+  template <typename action>
+  static bool intersect_id(const input_data_t &input_data, int primitive_id, vector_t ray_vec, action hit) {
+    if(primitive_id < 0 || primitive_id >= (int) input_data.spheres.size()) return false;
+    sphere_hits(ray_vec, input_data.spheres[primitive_id], primitive_id, hit);
+    return true;
+  }
+};
+
+/**
+ * Instances, traced in the object space of their mesh or sphere cluster. Triangles are
+ * two-sided, so their normals are turned to face the ray.
+ */
+struct instance_primitives_t {
+  /**
+   * Intersections of the ray with one instance, traced in its object space.
+   */
+  template <typename action>
+  static void intersect_instance(const input_data_t &input_data, const instance_t &instance, vector_t ray_vec, action hit) {
+    vector_t local_ray = object_ray(instance, ray_vec);
+    if(instance.kind == GEOMETRY_MESH) {
+      const mesh_t &mesh = input_data.meshes[instance.geometry];
+      position_t direction = ray_vec.direction.approximate();
+      intersect_mesh(mesh, local_ray, [&](int triangle, double t) {
+        position_t normal = world_normal(instance, triangle_normal(mesh, triangle));
+        if(dot(normal, direction) > 0) normal = normal * -1;
+        position_t point = ray_vec.origin + (ray_vec.direction * t).approximate();
+        hit(intersection_t { mesh.colors[triangle], point, pos_to_dir(normal), mesh.first_id + triangle });
+      });
+      return;
+    }
+    const sphere_cluster_t &cluster = input_data.clusters[instance.geometry];
+    traverse_bvh(cluster.bvh, local_ray, [&](int s) {
+      sphere_hits(local_ray, cluster.spheres[s], cluster.first_id + s, [&](intersection_t intersection) {
+        intersection.point = instance.to_world.apply_point(intersection.point);
+        intersection.normal_vector = pos_to_dir(world_normal(instance, intersection.normal_vector.approximate()));
+        hit(intersection);
+      });
+    });
+  }
+  template <typename action>
+  static void intersect(const input_data_t &input_data, vector_t ray_vec, action hit) {
+    traverse_bvh(input_data.instance_bvh, ray_vec, [&](int i) {
+      intersect_instance(input_data, input_data.instances[i], ray_vec, hit);
+    });
+  }
+  /**
+   * Only the top level is traversed by the whole batch; below an instance every ray
+   * has its own object space ray.
+   */
+  template <typename predicate, typename action>
+  static void intersect_queue(const input_data_t &input_data, const ray_queue_t &queue, int first, int last, predicate active, action hit) {
+    const bvh_t &bvh = input_data.instance_bvh;
+    traverse_bvh_stream(bvh, queue, first, last, active, [&](const bvh_node_t &node, const int *rays, int count) {
+      for(int k = 0; k < count; k++) {
+        int r = rays[k];
+        vector_t ray_vec = queue.ray(r);
+        for(int j = node.first; j < node.first + node.count; j++) {
+          intersect_instance(input_data, input_data.instances[bvh.indices[j]], ray_vec, [&](const intersection_t &intersection) {
+            hit(r, intersection);
+          });
+        }
+      }
+    });
+  }
+  static bool color(const input_data_t &input_data, int primitive_id, color_t *color) {
+    int mesh, triangle, cluster, sphere;
+    if(find_triangle(input_data, primitive_id, &mesh, &triangle)) {
+      *color = input_data.meshes[mesh].colors[triangle];
+      return true;
+    }
+    if(find_cluster_sphere(input_data, primitive_id, &cluster, &sphere)) {
+      *color = input_data.clusters[cluster].spheres[sphere].color;
+      return true;
+    }
+    return false;
+  }
+  /**
+   * An id names geometry every instance of it shares, not the instance that was hit,
+   * so none can be traced on its own.
+   */
+  template <typename action>
+  static bool intersect_id(const input_data_t &input_data, int primitive_id, vector_t ray_vec, action hit) {
+    return false;
+  }
+};
+
+struct ground_plane_primitive_t {
+  template <typename action>
+  static void intersect(const input_data_t &input_data, vector_t ray_vec, action hit) {
+    plane_t plane = input_data.ground_plane;
+    position_t p0 = plane.point;
+    position_t l0 = ray_vec.origin;
+    direction_t n = plane.normal_vector;
+    direction_t l = ray_vec.direction;
+    if(n.dot(l) == 0) return; // Ray runs parallel to the plane
+    double t = pos_to_dir(p0 - l0).dot(n) / l.dot(n);
+    position_t intersection_point = ray_vec.origin + (ray_vec.direction * t).approximate();
+    if(t >= 0) hit(intersection_t { plane.color, intersection_point, plane.normal_vector, GROUND_PLANE_ID });
+  }
+  template <typename predicate, typename action>
+  static void intersect_queue(const input_data_t &input_data, const ray_queue_t &queue, int first, int last, predicate active, action hit) {
+    intersect_each_ray<ground_plane_primitive_t>(input_data, queue, first, last, active, hit);
+  }
+  static bool color(const input_data_t &input_data, int primitive_id, color_t *color) {
+    if(primitive_id != GROUND_PLANE_ID) return false;
+    *color = input_data.ground_plane.color;
+    return true;
+  }
+  template <typename action>
+  static bool intersect_id(const input_data_t &input_data, int primitive_id, vector_t ray_vec, action hit) {
+    if(primitive_id != GROUND_PLANE_ID) return false;
+    intersect(input_data, ray_vec, hit);
+    return true;
+  }
+};
+
+typedef tuple<sphere_primitives_t, instance_primitives_t, ground_plane_primitive_t> primitive_types_t;
+
+/**
+ * Calls act(type) with a value of every registered primitive type, in order.
+ */
+template <typename action>
+void for_each_primitive_type(action act) {
+  apply([&](auto... types) { (act(types), ...); }, primitive_types_t());
+}
+
+/**
+ * Calls `hit` with every intersection of the ray with any primitive of the scene, in
+ * no particular order.
+ */
+template <typename action>
+void intersect_primitives(const input_data_t &input_data, vector_t ray_vec, action hit) {
+  for_each_primitive_type([&](auto type) {
+    decltype(type)::intersect(input_data, ray_vec, hit);
+  });
+}
+
+/**
+ * Calls hit(ray, intersection) with every intersection of the queued rays [first, last)
+ * with any primitive of the scene, for as long as active(ray) holds. Per ray the hits
+ * come in the order `intersect_primitives` gives them.
+ */
+template <typename predicate, typename action>
+void intersect_queue_primitives(const input_data_t &input_data, const ray_queue_t &queue, int first, int last, predicate active, action hit) {
+  for_each_primitive_type([&](auto type) {
+    decltype(type)::intersect_queue(input_data, queue, first, last, active, hit);
+  });
+}
+
+/**
+ * Color of the primitive with the given id, asked of every registered type in turn.
+ */
+bool registered_color(const input_data_t &input_data, int primitive_id, color_t *color) {
+  bool found = false;
+  for_each_primitive_type([&](auto type) {
+    if(!found) found = decltype(type)::color(input_data, primitive_id, color);
+  });
+  return found;
+}
+
+/**
+ * Calls `hit` with every intersection of the ray with the primitive of the given id
+ * alone. Returns false if no type can trace the id on its own.
+ */
+template <typename action>
+bool intersect_primitive(const input_data_t &input_data, int primitive_id, vector_t ray_vec, action hit) {
+  bool traced = false;
+  for_each_primitive_type([&](auto type) {
+    if(!traced) traced = decltype(type)::intersect_id(input_data, primitive_id, ray_vec, hit);
+  });
+  return traced;
+}
@@ -0,0 +1,245 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include <math.h>
+#include "main.h"
+#include "bvh.h"
+
+/**
+ * Rays handed to the intersection stages at once. Larger batches share more of every
+ * BVH node they visit; smaller ones keep the rays' working lists in cache.
+ */
+#define WAVEFRONT_BATCH 4096
+
+/**
+ * Nodes held by the simulated node cache of a queue, about what a 32 KB data cache
+ * holds of them.
+ */
+#define NODE_CACHE_SLOTS 512
+
+/**
+ * Orders shadow rays can be traced in: as they were queued, pixel by pixel through the
+ * tiles, or sorted by `sort_ray_queue`.
+ */
+enum ray_order_t {
+  RAY_ORDER_QUEUED,
+  RAY_ORDER_MORTON
+};
+
+/**
+ * Counters of the batched traversals. Every node a batch visits is fetched once and
+ * then box tested against all the batch's rays that reached its parent, so the share
+ * of those ray-node tests that did not need a fetch of their own tells how well the
+ * rays of a batch share nodes: the hit rate of a cache that holds the nodes of the
+ * batch's current path. Fetches that follow each other across batches are counted by
+ * `node_misses`, the misses of a direct mapped cache of NODE_CACHE_SLOTS nodes the
+ * queue keeps for as long as it lives; this is what the order of the batches changes.
+ */
+struct traversal_stats_t {
+  long long rays = 0;
+  long long batches = 0;
+  long long node_fetches = 0;
+  long long node_tests = 0;
+  long long node_misses = 0;
+
+  void add(const traversal_stats_t &other) {
+    this->rays += other.rays;
+    this->batches += other.batches;
+    this->node_fetches += other.node_fetches;
+    this->node_tests += other.node_tests;
+    this->node_misses += other.node_misses;
+  }
+  double node_hit_rate() const {
+    return this->node_tests == 0 ? 0 : 1 - (double) this->node_fetches / this->node_tests;
+  }
+};
+
+/**
+ * Rays in flight, as structure of arrays. Every ray remembers the G-buffer index of the
+ * pixel it works for, and carries its inverse direction for the box tests. The
+ * traversals the queue goes through count into `stats`.
+ */
+struct ray_queue_t {
+  vector<double> origin_x;
+  vector<double> origin_y;
+  vector<double> origin_z;
+  vector<double> direction_x;
+  vector<double> direction_y;
+  vector<double> direction_z;
+  vector<double> inverse_x;
+  vector<double> inverse_y;
+  vector<double> inverse_z;
+  vector<int> pixel;
+  mutable traversal_stats_t stats;
+  mutable vector<const bvh_node_t*> node_cache = vector<const bvh_node_t*>(NODE_CACHE_SLOTS);
+
+  int size() const {
+    return this->pixel.size();
+  }
+  void push(int pixel, vector_t ray_vec) {
+    this->origin_x.push_back(ray_vec.origin.x);
+    this->origin_y.push_back(ray_vec.origin.y);
+    this->origin_z.push_back(ray_vec.origin.z);
+    this->direction_x.push_back(ray_vec.direction.x);
+    this->direction_y.push_back(ray_vec.direction.y);
+    this->direction_z.push_back(ray_vec.direction.z);
+    this->inverse_x.push_back(1.0 / ray_vec.direction.x);
+    this->inverse_y.push_back(1.0 / ray_vec.direction.y);
+    this->inverse_z.push_back(1.0 / ray_vec.direction.z);
+    this->pixel.push_back(pixel);
+  }
+  vector_t ray(int index) const {
+    return vector_t {
+      position_t { this->origin_x[index], this->origin_y[index], this->origin_z[index] },
+      direction_t { this->direction_x[index], this->direction_y[index], this->direction_z[index] }
+    };
+  }
+  position_t origin(int index) const {
+    return position_t { this->origin_x[index], this->origin_y[index], this->origin_z[index] };
+  }
+  position_t inverse_direction(int index) const {
+    return position_t { this->inverse_x[index], this->inverse_y[index], this->inverse_z[index] };
+  }
+  /**
+   * Counts the fetch of a node in the stats, and whether the node cache missed it.
+   */
+  void fetch_node(const bvh_node_t *node) const {
+    const bvh_node_t *&slot = this->node_cache[((uintptr_t) node / sizeof(bvh_node_t)) % NODE_CACHE_SLOTS];
+    this->stats.node_fetches++;
+    this->stats.node_misses += slot != node;
+    slot = node;
+  }
+  /**
+   * Reorders the rays so that ray `order[j]` comes at j.
+   */
+  void permute(const vector<int> &order) {
+    for(vector<double> *column : { &this->origin_x, &this->origin_y, &this->origin_z, &this->direction_x,
+                                   &this->direction_y, &this->direction_z, &this->inverse_x, &this->inverse_y,
+                                   &this->inverse_z }) {
+      vector<double> permuted(order.size());
+      for(int j = 0; j < (int) order.size(); j++) permuted[j] = (*column)[order[j]];
+      *column = move(permuted);
+    }
+    vector<int> permuted(order.size());
+    for(int j = 0; j < (int) order.size(); j++) permuted[j] = this->pixel[order[j]];
+    this->pixel = move(permuted);
+  }
+};
+
+/**
+ * Spreads the low 20 bits of v out so that two zero bits follow each of them.
+ */
+unsigned long long spread_bits(unsigned long long v) {
+  v &= 0xfffff;
+  v = (v | v << 32) & 0x1f00000000ffffULL;
+  v = (v | v << 16) & 0x1f0000ff0000ffULL;
+  v = (v | v << 8) & 0x100f00f00f00f00fULL;
+  v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+  v = (v | v << 2) & 0x1249249249249249ULL;
+  return v;
+}
+
+/**
+ * Morton code of a cell of a 2^20 cubed grid: the bits of the three coordinates
+ * interleaved, so cells close along the Z-order curve are close in space.
+ */
+unsigned long long morton_code(unsigned x, unsigned y, unsigned z) {
+  return spread_bits(x) | spread_bits(y) << 1 | spread_bits(z) << 2;
+}
+
+/**
+ * Sorts the queued rays by the octant of their direction, then by the Morton code of
+ * their origin within the box around all origins. Rays that start close together and
+ * head the same way come next to each other, so a batch reaches fewer nodes. A queue
+ * holds the rays of a single light, so the light needs no key of its own.
+ */
+void sort_ray_queue(ray_queue_t *queue) {
+  int count = queue->size();
+  if(count < 2) return;
+  double low[3] = { INFINITY, INFINITY, INFINITY }, high[3] = { -INFINITY, -INFINITY, -INFINITY };
+  const vector<double> *origins[3] = { &queue->origin_x, &queue->origin_y, &queue->origin_z };
+  for(int axis = 0; axis < 3; axis++) {
+    for(double value : *origins[axis]) {
+      low[axis] = min(low[axis], value);
+      high[axis] = max(high[axis], value);
+    }
+  }
+  vector<pair<unsigned long long, int>> keys(count);
+  for(int r = 0; r < count; r++) {
+    unsigned cell[3];
+    for(int axis = 0; axis < 3; axis++) {
+      double extent = high[axis] - low[axis];
+      double unit = extent > 0 ? ((*origins[axis])[r] - low[axis]) / extent : 0;
+      cell[axis] = min(0xfffff, (int) (unit * 0xfffff));
+    }
+    unsigned long long octant = (queue->direction_x[r] < 0) | (queue->direction_y[r] < 0) << 1 | (queue->direction_z[r] < 0) << 2;
+    keys[r] = make_pair(octant << 60 | morton_code(cell[0], cell[1], cell[2]), r);
+  }
+  sort(keys.begin(), keys.end());
+  vector<int> order(count);
+  for(int j = 0; j < count; j++) order[j] = keys[j].second;
+  queue->permute(order);
+}
+
+/**
+ * Calls act(first, last) for consecutive batches [first, last) of at most
+ * WAVEFRONT_BATCH queued rays.
+ */
+template <typename action>
+void for_each_batch(const ray_queue_t &queue, action act) {
+  queue.stats.rays += queue.size();
+  for(int first = 0; first < queue.size(); first += WAVEFRONT_BATCH) {
+    queue.stats.batches++;
+    act(first, min(queue.size(), first + WAVEFRONT_BATCH));
+  }
+}
+
+/**
+ * Traverses the BVH with the queued rays [first, last) together. Every node is visited
+ * once for all the rays that reach it: the rays of its parent are tested against its
+ * box and the survivors are compacted into a new list, which is what its children start
+ * from. Rays for which active(ray) turned false, like shadow rays that are already
+ * blocked, are dropped along the way. visit_leaf(node, rays, count) gets every leaf with
+ * the queue indexes of the rays that reached it.
+ *
+ * A ray reaches the same leaves in the same order as `traverse_bvh_leaves` would take
+ * it, so per ray the results are exactly those of the single ray traversal.
+ */
+template <typename predicate, typename action>
+void traverse_bvh_stream(const bvh_t &bvh, const ray_queue_t &queue, int first, int last, predicate active, action visit_leaf) {
+  if(bvh.nodes.empty() || first >= last) return;
+  /* The lists of the nodes on the current path, one after the other */
+  vector<int> lanes;
+  lanes.reserve(8 * (last - first));
+  for(int r = first; r < last; r++) lanes.push_back(r);
+  struct entry_t {
+    int node;
+    int begin;
+    int end;
+  };
+  entry_t stack[BVH_STACK_SIZE];
+  int top = 0;
+  stack[top++] = entry_t { 0, 0, (int) lanes.size() };
+  while(top > 0) {
+    entry_t entry = stack[--top];
+    /* Whatever lies past the parent's list belongs to subtrees that are done */
+    lanes.resize(entry.end);
+    const bvh_node_t &node = bvh.nodes[entry.node];
+    queue.fetch_node(&node);
+    queue.stats.node_tests += entry.end - entry.begin;
+    for(int k = entry.begin; k < entry.end; k++) {
+      int r = lanes[k];
+      if(active(r) && node.bounds.hit(queue.origin(r), queue.inverse_direction(r))) lanes.push_back(r);
+    }
+    int begin = entry.end, end = lanes.size();
+    if(begin == end) continue;
+    if(node.count > 0) {
+      visit_leaf(node, lanes.data() + begin, end - begin);
+    } else {
+      stack[top++] = entry_t { node.first + 1, begin, end };
+      stack[top++] = entry_t { node.first, begin, end };
+    }
+  }
+}
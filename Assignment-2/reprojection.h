@@ -0,0 +1,147 @@
+#pragma once
+
+#include <vector>
+#include <math.h>
+#include "main.h"
+#include "scene.h"
+#include "camera.h"
+#include "gbuffer.h"
+#include "scene_diff.h"
+
+/**
+ * Largest relative difference between the distance of a reprojected hit from the new
+ * eye and the distance the new primary ray finds on the same primitive for the hit to
+ * be reused. A reprojected hit lands up to half a pixel off the ray of its pixel, so
+ * this has to allow for the slope of the surface across a pixel.
+ */
+#define REPROJECTION_DEPTH_TOLERANCE 0.01
+
+/**
+ * Pixels on every side of the source of a reused hit that must have hit the same
+ * primitive and seen a light the same way for its visibility of the light to be
+ * reused, so that no shadow edge runs between them.
+ */
+#define REPROJECTION_EDGE_MARGIN 1
+
+/**
+ * The hits of a previous frame as seen by a new camera: for every pixel the previous
+ * G-buffer index of the closest hit that landed on it, its primitive and its distance
+ * from the new eye, or -1 and NO_PRIMITIVE where none did. Indexed like the G-buffer.
+ */
+struct reprojection_t {
+  int width;
+  int height;
+  vector<int> source;
+  vector<int> primitive_id;
+  vector<double> distance;
+};
+
+/**
+ * Moves every hit of the previous G-buffer to the pixel of the new camera whose corner
+ * it lands closest to, keeping the closest hit where several land on one pixel.
+ * Pixels the new camera sees more closely than the previous one get no hit, like the
+ * ones behind what moved aside, and are traced anew.
+ */
+reprojection_t reproject(const gbuffer_t &previous, const camera_t &camera) {
+  int width = previous.width, height = previous.height;
+  reprojection_t reprojection = reprojection_t {
+    width, height, vector<int>(width * height, -1), vector<int>(width * height, NO_PRIMITIVE),
+    vector<double>(width * height, INFINITY)
+  };
+  for(int i = 0; i < previous.size(); i++) {
+    if(previous.primitive_id[i] == NO_PRIMITIVE) continue;
+    position_t point = previous.point(i);
+    double x, y;
+    if(!project_to_pixel(camera, point, &x, &y)) continue;
+    int px = (int) floor(x + 0.5), py = (int) floor(y + 0.5);
+    if(px < 0 || px >= width || py < 0 || py >= height) continue;
+    int j = px * height + py;
+    double distance = (point - camera.eye).length();
+    if(distance < reprojection.distance[j]) {
+      reprojection.distance[j] = distance;
+      reprojection.source[j] = i;
+      reprojection.primitive_id[j] = previous.primitive_id[i];
+    }
+  }
+  return reprojection;
+}
+
+/**
+ * Signed distances of a point from the planes bounding the view of the camera, all
+ * positive inside: the plane of the eye, then the four planes through the eye and the
+ * edges of the image plane.
+ */
+void view_plane_distances(const camera_t &camera, position_t point, double distances[5]) {
+  position_t rel = camera.to_camera(point);
+  position_t normals[5] = {
+    position_t { 0, 0, 1 },
+    position_t { PLANE_Z, 0, -PLANE_START_X }, position_t { -PLANE_Z, 0, PLANE_END_X },
+    position_t { 0, PLANE_Z, -PLANE_START_Y }, position_t { 0, -PLANE_Z, PLANE_END_Y }
+  };
+  for(int k = 0; k < 5; k++) distances[k] = dot(rel, normalized(normals[k]));
+}
+
+bool sphere_outside_view(const camera_t &camera, sphere_t sphere) {
+  double distances[5];
+  view_plane_distances(camera, sphere.center, distances);
+  for(double distance : distances) {
+    if(distance < -sphere.radius) return true;
+  }
+  return false;
+}
+
+/**
+ * Part of the new view where a primitive may lie in front of whatever lies farther
+ * than `distance` from the new eye. Instances take NO_PRIMITIVE, since the ids of
+ * their hits name shared geometry and not the instance.
+ */
+struct occluder_region_t {
+  screen_rect_t rect;
+  double distance;
+  int primitive_id;
+};
+
+/**
+ * Distance from the eye of the camera to the closest point of the sphere, or 0 from
+ * inside it.
+ */
+double near_distance(const camera_t &camera, sphere_t sphere) {
+  position_t eye = camera.eye;
+  return max(0.0, (sphere.center - eye).length() - sphere.radius);
+}
+
+/**
+ * Whether the ray passes within the radius of the center of the sphere, with some
+ * slack for rounding, so that no hit on the sphere is lost.
+ */
+bool ray_may_meet_sphere(vector_t ray_vec, sphere_t sphere) {
+  position_t direction = ray_vec.direction.approximate(), to_center = sphere.center - ray_vec.origin;
+  double along = dot(to_center, direction) / dot(direction, direction);
+  double squared_miss = dot(to_center, to_center) - along * dot(to_center, direction);
+  return squared_miss <= (double) sphere.radius * sphere.radius * (1 + 1e-6) + EPSILON;
+}
+
+/**
+ * Regions of the new view every sphere and instance in it may cover, each at the
+ * closest it comes to the new eye. A ray can only meet a primitive inside its region,
+ * where `ray_may_meet_sphere` narrows down the pixels of a sphere, and no nearer than
+ * its distance, so a hit on one primitive is the closest one of the ray when every
+ * other region over its pixel is farther away than the hit.
+ */
+vector<occluder_region_t> occluder_regions(const input_data_t &input_data, const camera_t &camera) {
+  vector<occluder_region_t> regions;
+  for(int s = 0; s < (int) input_data.spheres.size(); s++) {
+    sphere_t sphere = input_data.spheres[s];
+    if(sphere_outside_view(camera, sphere)) continue;
+    regions.push_back(occluder_region_t { projected_rect(camera, sphere_box_corners(sphere)), near_distance(camera, sphere), s });
+  }
+  for(const instance_t & instance : input_data.instances) {
+    sphere_t bounds = box_sphere(instance.bounds);
+    if(!sphere_outside_view(camera, bounds)) {
+      regions.push_back(occluder_region_t {
+        projected_rect(camera, box_corners(instance.bounds)), near_distance(camera, bounds), NO_PRIMITIVE
+      });
+    }
+  }
+  return regions;
+}
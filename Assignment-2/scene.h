@@ -0,0 +1,181 @@
+#pragma once
+
+#include <vector>
+#include "main.h"
+#include "bvh.h"
+#include "grid.h"
+#include "mesh.h"
+#include "instance.h"
+#include "ray_queue.h"
+#include "tiles.h"
+
+/**
+ * Acceleration structures the renderer can trace through. Only the selected one is
+ * built.
+ */
+enum acceleration_t {
+  ACCELERATION_BVH,
+  ACCELERATION_GRID,
+  ACCELERATION_TWO_LEVEL_GRID
+};
+
+/**
+ * Sphere centers and radii in the leaf order of the sphere BVH, one array per field, so
+ * a leaf is prefiltered in a straight loop over contiguous memory.
+ */
+struct sphere_soa_t {
+  vector<double> x;
+  vector<double> y;
+  vector<double> z;
+  vector<double> radius;
+};
+
+/**
+ * The scene as read from the input, along with the acceleration structure built over
+ * its spheres. Meshes and sphere clusters are shared geometry with a BVH of their own,
+ * placed in the scene only through `instances`, over which `instance_bvh` is the top
+ * level. With the BVH, `sphere_soa` mirrors the spheres in its leaf order. Like the
+ * acceleration structure, the orders tiles and shadow rays are traced in, the
+ * supersampling of edges and the size of the lights are picked on the command line:
+ * with a `light_radius`, every light is a sphere sampled with up to `light_samples`
+ * shadow rays, and the scene spheres and the ground plane mirror the given share of
+ * the light they get, with up to `reflection_rays` reflection rays per pixel. Whoever
+ * changes `spheres` is responsible for calling `update_acceleration`, whoever changes
+ * instances for calling `build_instances`.
+ */
+struct input_data_t {
+  vector<sphere_t> spheres;
+  vector<position_t> light_positions;
+  plane_t ground_plane;
+  vector<mesh_t> meshes;
+  vector<sphere_cluster_t> clusters;
+  vector<instance_t> instances;
+  bvh_t instance_bvh;
+  acceleration_t acceleration = ACCELERATION_BVH;
+  ray_order_t shadow_ray_order = RAY_ORDER_QUEUED;
+  tile_order_t tile_order = TILE_ORDER_COLUMNS;
+  int antialias_side = 1;
+  double light_radius = 0;
+  int light_samples = AREA_LIGHT_SAMPLES;
+  double sphere_reflectivity = 0;
+  double plane_reflectivity = 0;
+  int reflection_rays = REFLECTION_RAY_BUDGET;
+  bvh_t bvh;
+  sphere_soa_t sphere_soa;
+  sphere_grid_t grid;
+};
+
+/**
+ * Calls `visit` with the index of every sphere the selected structure cannot rule out
+ * for the ray.
+ */
+template <typename action>
+void traverse_scene(const input_data_t &input_data, vector_t ray_vec, action visit) {
+  if(input_data.acceleration == ACCELERATION_BVH) {
+    traverse_bvh(input_data.bvh, ray_vec, visit);
+  } else {
+    traverse_grid(input_data.grid, ray_vec, visit);
+  }
+}
+
+/**
+ * Copies the spheres into `sphere_soa` in the leaf order of the BVH.
+ */
+void update_sphere_soa(input_data_t *input_data) {
+  const vector<int> &indices = input_data->bvh.indices;
+  sphere_soa_t &soa = input_data->sphere_soa;
+  soa.x.resize(indices.size());
+  soa.y.resize(indices.size());
+  soa.z.resize(indices.size());
+  soa.radius.resize(indices.size());
+  parallel_chunks(0, indices.size(), thread_pool().size(), [&](int chunk, int begin, int end) {
+    for(int j = begin; j < end; j++) {
+      const sphere_t &sphere = input_data->spheres[indices[j]];
+      soa.x[j] = sphere.center.x;
+      soa.y[j] = sphere.center.y;
+      soa.z[j] = sphere.center.z;
+      soa.radius[j] = sphere.radius;
+    }
+  });
+}
+
+/**
+ * Brings the selected structure up to date after spheres changed. The BVH is refitted
+ * (and rebuilt when that degraded it too much); grids are rebuilt, which is linear.
+ */
+void update_acceleration(input_data_t *input_data) {
+  if(input_data->acceleration == ACCELERATION_BVH) {
+    update_bvh(&input_data->bvh, input_data->spheres);
+    update_sphere_soa(input_data);
+  } else {
+    input_data->grid = build_grid(input_data->spheres, input_data->acceleration == ACCELERATION_TWO_LEVEL_GRID);
+  }
+}
+
+/**
+ * Numbers the primitives of the shared geometry: mesh triangles follow the spheres,
+ * mesh by mesh, and cluster spheres follow the triangles. The ids name the geometry,
+ * so every instance of a mesh shares them.
+ */
+void assign_primitive_ids(input_data_t *input_data) {
+  int id = input_data->spheres.size();
+  for(mesh_t & mesh : input_data->meshes) {
+    mesh.first_id = id;
+    id += mesh.triangle_count();
+  }
+  for(sphere_cluster_t & cluster : input_data->clusters) {
+    cluster.first_id = id;
+    id += cluster.spheres.size();
+  }
+}
+
+/**
+ * Refreshes the world bounds of every instance and rebuilds the top level BVH over
+ * them. Only instance boxes are involved, so this is cheap enough to redo whenever
+ * instances move; the shared structures are left alone.
+ */
+void build_instances(input_data_t *input_data) {
+  assign_primitive_ids(input_data);
+  vector<bvh_ref_t> refs(input_data->instances.size());
+  for(int i = 0; i < (int) input_data->instances.size(); i++) {
+    instance_t &instance = input_data->instances[i];
+    aabb_t local = instance.kind == GEOMETRY_MESH
+      ? input_data->meshes[instance.geometry].bounds()
+      : input_data->clusters[instance.geometry].bounds();
+    instance.bounds = transform_bounds(instance.to_world, local);
+    refs[i] = bvh_ref_t { instance.bounds, (instance.bounds.low + instance.bounds.high) * 0.5, i };
+  }
+  input_data->instance_bvh = build_bvh_over(move(refs));
+}
+
+/**
+ * Finds the mesh and triangle behind a primitive id. Returns false for ids that are
+ * not triangles.
+ */
+bool find_triangle(const input_data_t &input_data, int primitive_id, int *mesh, int *triangle) {
+  for(int m = 0; m < (int) input_data.meshes.size(); m++) {
+    int index = primitive_id - input_data.meshes[m].first_id;
+    if(index >= 0 && index < input_data.meshes[m].triangle_count()) {
+      *mesh = m;
+      *triangle = index;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Finds the cluster and sphere behind a primitive id. Returns false for ids that are
+ * not cluster spheres.
+ */
+bool find_cluster_sphere(const input_data_t &input_data, int primitive_id, int *cluster, int *sphere) {
+  for(int c = 0; c < (int) input_data.clusters.size(); c++) {
+    int index = primitive_id - input_data.clusters[c].first_id;
+    if(index >= 0 && index < (int) input_data.clusters[c].spheres.size()) {
+      *cluster = c;
+      *sphere = index;
+      return true;
+    }
+  }
+  return false;
+}
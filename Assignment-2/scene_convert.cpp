@@ -0,0 +1,34 @@
+#include <iostream>
+#include <string>
+#include <math.h>
+#include "main.h"
+#include "scene.h"
+#include "scene_file.h"
+
+using namespace std;
+
+/**
+ * Converts a text scene (see `parse_text_scene` for the format) into a binary scene
+ * file that `main --scene` loads without parsing.
+ *
+ * Usage: ./scene_convert scene.txt scene.scn
+ */
+int main(int argc, char **argv) {
+  if(argc != 3) {
+    cout << "Usage: " << argv[0] << " input.txt output.scn" << endl;
+    return 1;
+  }
+  input_data_t input_data;
+  string error;
+  if(!load_text_scene(argv[1], &input_data, &error)) {
+    cout << "Cannot convert " << error << "." << endl;
+    return 1;
+  }
+  if(!write_binary_scene(argv[2], input_data)) {
+    cout << "Cannot write " << argv[2] << "." << endl;
+    return 1;
+  }
+  cout << "Wrote " << input_data.spheres.size() << " spheres and " << input_data.light_positions.size()
+       << " light sources to " << argv[2] << "." << endl;
+  return 0;
+}
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <vector>
+#include <math.h>
+#include "main.h"
+#include "scene.h"
+#include "tiles.h"
+#include "shadow_mask.h"
+
+/**
+ * Extra pixels added around every projected region to absorb rounding at its edges.
+ */
+#define SCREEN_RECT_MARGIN 2
+
+/**
+ * A rectangle of pixels a scene edit may have changed, inclusive on both ends.
+ */
+struct screen_rect_t {
+  int x_start;
+  int y_start;
+  int x_end;
+  int y_end;
+};
+
+screen_rect_t full_screen() {
+  return screen_rect_t { 0, 0, IMAGE_WIDTH - 1, IMAGE_HEIGHT - 1 };
+}
+
+/**
+ * Pixel coordinates of the image of a world point, fractional, in the image of the
+ * camera. Returns false for points that are not in front of the camera.
+ */
+bool project_to_pixel(const camera_t &camera, position_t point, double *x, double *y) {
+  position_t rel = camera.to_camera(point);
+  if(rel.z <= 0) return false;
+  *x = (rel.x * PLANE_Z / rel.z - PLANE_START_X) * RESOLUTION_COEFF;
+  *y = (rel.y * PLANE_Z / rel.z - PLANE_START_Y) * RESOLUTION_COEFF;
+  return true;
+}
+
+/**
+ * Screen-space bounding rectangle of a set of world points, as seen from the camera
+ * through its image plane. The image of the convex hull of the points is the convex
+ * hull of their images, as long as all of them are in front of the camera; otherwise
+ * the whole screen is returned.
+ */
+screen_rect_t projected_rect(const camera_t &camera, const vector<position_t> &points) {
+  double x_min = INFINITY, x_max = -INFINITY, y_min = INFINITY, y_max = -INFINITY;
+  for(position_t point : points) {
+    double x, y;
+    if(!project_to_pixel(camera, point, &x, &y)) return full_screen();
+    x_min = min(x_min, x);
+    x_max = max(x_max, x);
+    y_min = min(y_min, y);
+    y_max = max(y_max, y);
+  }
+  return screen_rect_t {
+    max(0, (int) floor(x_min) - SCREEN_RECT_MARGIN),
+    max(0, (int) floor(y_min) - SCREEN_RECT_MARGIN),
+    min(IMAGE_WIDTH - 1, (int) ceil(x_max) + SCREEN_RECT_MARGIN),
+    min(IMAGE_HEIGHT - 1, (int) ceil(y_max) + SCREEN_RECT_MARGIN)
+  };
+}
+
+/**
+ * Corners of the axis aligned bounding box of a sphere.
+ */
+vector<position_t> sphere_box_corners(sphere_t sphere) {
+  vector<position_t> corners;
+  double r = sphere.radius;
+  for(int corner = 0; corner < 8; corner++) {
+    position_t offset = position_t { (corner & 1) ? r : -r, (corner & 2) ? r : -r, (corner & 4) ? r : -r };
+    corners.push_back(sphere.center + offset);
+  }
+  return corners;
+}
+
+/**
+ * Corners of a box.
+ */
+vector<position_t> box_corners(aabb_t box) {
+  vector<position_t> corners;
+  for(int corner = 0; corner < 8; corner++) {
+    corners.push_back(position_t {
+      (corner & 1) ? box.high.x : box.low.x,
+      (corner & 2) ? box.high.y : box.low.y,
+      (corner & 4) ? box.high.z : box.low.z
+    });
+  }
+  return corners;
+}
+
+/**
+ * Sphere enclosing a box, for testing instances against shadow cones the way spheres
+ * are.
+ */
+sphere_t box_sphere(aabb_t box) {
+  position_t center = (box.low + box.high) * 0.5;
+  position_t half_diagonal = box.high - center;
+  return sphere_t { PLANE_COLOR, center, (int) ceil(half_diagonal.length()) };
+}
+
+/**
+ * Whether `receiver` may be partly inside the shadow cone `occluder` casts from the
+ * light, beyond the occluder itself.
+ */
+bool in_shadow_cone(sphere_t occluder, sphere_t receiver, position_t light) {
+  position_t axis = occluder.center - light;
+  position_t to_receiver = receiver.center - light;
+  double axis_length = axis.length();
+  double receiver_distance = to_receiver.length();
+  if(receiver_distance <= receiver.radius) return true;
+  if(receiver_distance + receiver.radius < axis_length - occluder.radius) return false;
+  double half_angle = asin(min(1.0, occluder.radius / axis_length));
+  double receiver_angle = asin(receiver.radius / receiver_distance);
+  double angle = acos(max(-1.0, min(1.0, dot(axis, to_receiver) / (axis_length * receiver_distance))));
+  return angle <= half_angle + receiver_angle;
+}
+
+/**
+ * Conservative screen footprint of the shadow volume a sphere casts from a light. The
+ * shadow can only land on the ground plane, on other spheres or on instances: on the
+ * plane it is bounded by the sphere's box projected from the light, and every sphere
+ * or instance the shadow cone may reach is added whole.
+ */
+vector<screen_rect_t> shadow_volume_rects(const input_data_t &input_data, const camera_t &camera, sphere_t sphere, position_t light) {
+  vector<screen_rect_t> rects;
+  plane_t ground_plane = input_data.ground_plane;
+  if((sphere.center - light).length() <= sphere.radius) return { full_screen() };
+
+  /* Footprint on the ground plane */
+  position_t normal = normalized(ground_plane.normal_vector.approximate());
+  if(dot(light - ground_plane.point, normal) < 0) normal = normal * -1;
+  double light_height = dot(light - ground_plane.point, normal);
+  vector<position_t> corners = sphere_box_corners(sphere);
+  vector<position_t> footprint;
+  int above_light = 0;
+  for(position_t corner : corners) {
+    position_t projected;
+    if(project_from_light(light, corner, ground_plane.point, normal, &projected)) {
+      footprint.push_back(projected);
+    } else if(dot(corner - ground_plane.point, normal) >= light_height) {
+      above_light++;
+    }
+  }
+  if(footprint.size() == corners.size()) {
+    rects.push_back(projected_rect(camera, footprint));
+  } else if(above_light != (int) corners.size()) {
+    return { full_screen() };
+  }
+
+  /* Spheres and instances the shadow may fall on */
+  for(sphere_t receiver : input_data.spheres) {
+    if(in_shadow_cone(sphere, receiver, light)) rects.push_back(projected_rect(camera, sphere_box_corners(receiver)));
+  }
+  for(const instance_t & instance : input_data.instances) {
+    if(in_shadow_cone(sphere, box_sphere(instance.bounds), light)) rects.push_back(projected_rect(camera, box_corners(instance.bounds)));
+  }
+  return rects;
+}
+
+/**
+ * Scene diff of a single sphere edit: every screen region whose primary or shadow rays
+ * could touch the sphere at either its old or its new position. A shadow ray towards
+ * a point of an area light passes within `light_radius` of the ray towards its center
+ * all along, so the shadow volume of the sphere grown by the radius, rounded up to
+ * the whole units sphere radii come in, cast from the center, holds the penumbra.
+ * Regions are in the image of the given camera.
+ */
+vector<screen_rect_t> sphere_edit_regions(const input_data_t &input_data, const camera_t &camera, sphere_t old_sphere, sphere_t new_sphere) {
+  vector<screen_rect_t> regions;
+  for(sphere_t sphere : { old_sphere, new_sphere }) {
+    regions.push_back(projected_rect(camera, sphere_box_corners(sphere)));
+    sphere_t occluder = sphere;
+    occluder.radius += (int) ceil(input_data.light_radius);
+    for(position_t light : input_data.light_positions) {
+      for(screen_rect_t rect : shadow_volume_rects(input_data, camera, occluder, light)) regions.push_back(rect);
+    }
+  }
+  return regions;
+}
+
+/**
+ * Indexes of the tiles overlapping any of the regions.
+ */
+vector<int> dirty_tiles(const vector<tile_t> &tiles, const vector<screen_rect_t> &regions) {
+  vector<int> dirty;
+  for(int i = 0; i < (int) tiles.size(); i++) {
+    for(const screen_rect_t & region : regions) {
+      if(tiles[i].x_start <= region.x_end && region.x_start < tiles[i].x_end &&
+         tiles[i].y_start <= region.y_end && region.y_start < tiles[i].y_end) {
+        dirty.push_back(i);
+        break;
+      }
+    }
+  }
+  return dirty;
+}
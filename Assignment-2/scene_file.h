@@ -0,0 +1,335 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <charconv>
+#include <algorithm>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "main.h"
+#include "scene.h"
+#include "thread_pool.h"
+
+/**
+ * Binary scene files start with this magic and version. The version is bumped whenever
+ * the layout of the header or of the records changes.
+ */
+#define SCENE_FILE_MAGIC "SPHSCN\r\n"
+#define SCENE_FILE_VERSION 1
+
+/**
+ * Header of a binary scene file. Each array is stored at its offset from the start of
+ * the file, 8-byte aligned, as records laid out exactly like the renderer's own
+ * sphere_t, position_t and plane_t, so loading is a copy and not a parse. Materials
+ * are stored where the renderer keeps them, in the color of each sphere and plane.
+ * The record sizes guard against reading a file written by a build whose layout
+ * differs.
+ */
+struct scene_file_header_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t sphere_size;
+  uint32_t light_size;
+  uint32_t plane_size;
+  uint64_t sphere_count;
+  uint64_t light_count;
+  uint64_t plane_count;
+  uint64_t sphere_offset;
+  uint64_t light_offset;
+  uint64_t plane_offset;
+};
+
+/**
+ * The default ground plane, used by scenes that do not give one.
+ */
+plane_t default_ground_plane() {
+  return plane_t { position_t { 0, 0, 700 }, direction_t { 0, 0, -1 }, PLANE_COLOR };
+}
+
+/**
+ * Tells whether the file at `path` starts like a binary scene file.
+ */
+bool is_binary_scene(const string &path) {
+  char magic[8];
+  FILE *file = fopen(path.c_str(), "rb");
+  if(file == NULL) return false;
+  bool binary = fread(magic, sizeof(magic), 1, file) == 1 && memcmp(magic, SCENE_FILE_MAGIC, sizeof(magic)) == 0;
+  fclose(file);
+  return binary;
+}
+
+/**
+ * Whether the array of `count` records of `size` bytes at `offset` lies inside a file
+ * of `file_size` bytes.
+ */
+bool section_fits(uint64_t offset, uint64_t count, uint64_t size, uint64_t file_size) {
+  if(offset % 8 != 0 || offset > file_size) return false;
+  return count <= (file_size - offset) / size;
+}
+
+/**
+ * Loads a binary scene file into *input_data. The file is memory-mapped and each array
+ * copied out of the mapping in one go. A scene holds at most one plane, the ground
+ * plane; without one the default ground plane is used. On failure *error says why and
+ * *input_data is left alone.
+ */
+bool load_binary_scene(const string &path, input_data_t *input_data, string *error) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if(fd < 0) {
+    *error = "cannot open " + path;
+    return false;
+  }
+  struct stat info;
+  if(fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(scene_file_header_t)) {
+    close(fd);
+    *error = path + " is too short to be a scene file";
+    return false;
+  }
+  size_t size = info.st_size;
+  void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(mapping == MAP_FAILED) {
+    *error = "cannot map " + path;
+    return false;
+  }
+
+  const char *data = (const char*) mapping;
+  scene_file_header_t header;
+  memcpy(&header, data, sizeof(header));
+  if(memcmp(header.magic, SCENE_FILE_MAGIC, sizeof(header.magic)) != 0) {
+    *error = path + " is not a binary scene file";
+  } else if(header.version != SCENE_FILE_VERSION) {
+    *error = path + " has version " + to_string(header.version) + ", expected " + to_string(SCENE_FILE_VERSION);
+  } else if(header.sphere_size != sizeof(sphere_t) || header.light_size != sizeof(position_t) || header.plane_size != sizeof(plane_t)) {
+    *error = path + " was written with a different record layout";
+  } else if(!section_fits(header.sphere_offset, header.sphere_count, sizeof(sphere_t), size)
+            || !section_fits(header.light_offset, header.light_count, sizeof(position_t), size)
+            || !section_fits(header.plane_offset, header.plane_count, sizeof(plane_t), size)) {
+    *error = path + " is truncated";
+  } else if(header.plane_count > 1) {
+    *error = path + " has " + to_string(header.plane_count) + " planes, only a single ground plane is supported";
+  } else {
+    const sphere_t *spheres = (const sphere_t*) (data + header.sphere_offset);
+    const position_t *lights = (const position_t*) (data + header.light_offset);
+    const plane_t *planes = (const plane_t*) (data + header.plane_offset);
+    input_data->spheres.assign(spheres, spheres + header.sphere_count);
+    input_data->light_positions.assign(lights, lights + header.light_count);
+    input_data->ground_plane = header.plane_count == 1 ? planes[0] : default_ground_plane();
+    error->clear();
+  }
+  munmap(mapping, size);
+  return error->empty();
+}
+
+/**
+ * Writes a binary scene file holding the spheres, lights and ground plane of the scene.
+ */
+bool write_binary_scene(const string &path, const input_data_t &input_data) {
+  scene_file_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SCENE_FILE_MAGIC, sizeof(header.magic));
+  header.version = SCENE_FILE_VERSION;
+  header.sphere_size = sizeof(sphere_t);
+  header.light_size = sizeof(position_t);
+  header.plane_size = sizeof(plane_t);
+  header.sphere_count = input_data.spheres.size();
+  header.light_count = input_data.light_positions.size();
+  header.plane_count = 1;
+  header.sphere_offset = sizeof(header);
+  header.light_offset = header.sphere_offset + header.sphere_count * sizeof(sphere_t);
+  header.plane_offset = header.light_offset + header.light_count * sizeof(position_t);
+
+  FILE *file = fopen(path.c_str(), "wb");
+  if(file == NULL) return false;
+  bool written = fwrite(&header, sizeof(header), 1, file) == 1
+    && fwrite(input_data.spheres.data(), sizeof(sphere_t), header.sphere_count, file) == header.sphere_count
+    && fwrite(input_data.light_positions.data(), sizeof(position_t), header.light_count, file) == header.light_count
+    && fwrite(&input_data.ground_plane, sizeof(plane_t), 1, file) == 1;
+  return fclose(file) == 0 && written;
+}
+
+/**
+ * What one chunk of a text scene parses into. `lines` counts the lines of the chunk;
+ * on a parse error `error_line` is the chunk-local number of the offending line.
+ */
+struct text_chunk_t {
+  vector<sphere_t> spheres;
+  vector<position_t> light_positions;
+  vector<plane_t> planes;
+  int lines;
+  int error_line;
+  string error_text;
+};
+
+bool is_blank(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+/**
+ * Reads one number from [*p, end) with from_chars, skipping leading blanks. The number
+ * must be followed by a blank or the end of the range.
+ */
+template <typename number>
+bool read_field(const char **p, const char *end, number *value) {
+  const char *start = *p;
+  while(start < end && is_blank(*start)) start++;
+  from_chars_result result = from_chars(start, end, *value);
+  if(result.ec != errc() || (result.ptr < end && !is_blank(*result.ptr))) return false;
+  *p = result.ptr;
+  return true;
+}
+
+/**
+ * Parses the complete lines in [begin, end) into *chunk. Stops at the first line it
+ * cannot read.
+ */
+void parse_text_chunk(const char *begin, const char *end, text_chunk_t *chunk) {
+  chunk->lines = 0;
+  chunk->error_line = -1;
+  chunk->spheres.reserve((end - begin) / 32);
+  for(const char *line = begin; line < end; ) {
+    const char *line_end = (const char*) memchr(line, '\n', end - line);
+    if(line_end == NULL) line_end = end;
+    chunk->lines++;
+
+    const char *p = line;
+    while(p < line_end && is_blank(*p)) p++;
+    const char *kind = p;
+    while(p < line_end && !is_blank(*p)) p++;
+    string_view keyword(kind, p - kind);
+    bool parsed = true;
+    if(keyword.empty() || keyword[0] == '#') {
+      p = line_end; // Blank line or comment
+    } else if(keyword == "sphere") {
+      sphere_t sphere = sphere_t { color_t { 0, 0, 0, AMBIENT_LIGHT } };
+      parsed = read_field(&p, line_end, &sphere.color.R) && read_field(&p, line_end, &sphere.color.G)
+        && read_field(&p, line_end, &sphere.color.B) && read_field(&p, line_end, &sphere.center.x)
+        && read_field(&p, line_end, &sphere.center.y) && read_field(&p, line_end, &sphere.center.z)
+        && read_field(&p, line_end, &sphere.radius);
+      chunk->spheres.push_back(sphere);
+    } else if(keyword == "light") {
+      position_t light;
+      parsed = read_field(&p, line_end, &light.x) && read_field(&p, line_end, &light.y) && read_field(&p, line_end, &light.z);
+      chunk->light_positions.push_back(light);
+    } else if(keyword == "plane") {
+      plane_t plane = plane_t { position_t { 0, 0, 0 }, direction_t { 0, 0, 0 }, PLANE_COLOR };
+      parsed = read_field(&p, line_end, &plane.point.x) && read_field(&p, line_end, &plane.point.y)
+        && read_field(&p, line_end, &plane.point.z) && read_field(&p, line_end, &plane.normal_vector.x)
+        && read_field(&p, line_end, &plane.normal_vector.y) && read_field(&p, line_end, &plane.normal_vector.z);
+      chunk->planes.push_back(plane);
+    } else {
+      parsed = false;
+    }
+    while(parsed && p < line_end && is_blank(*p)) p++;
+    if(!parsed || p < line_end) {
+      chunk->error_line = chunk->lines;
+      chunk->error_text = string(line, line_end);
+      return;
+    }
+    line = line_end + 1;
+  }
+}
+
+/**
+ * Parses the text scene format, one object per line:
+ *
+ *   sphere R G B x y z radius
+ *   light x y z
+ *   plane x y z nx ny nz
+ *
+ * with the fields in the order the interactive prompts ask for them. Blank lines and
+ * lines starting with '#' are skipped. At most one plane may be given; without one the
+ * default ground plane is used. On failure *error names the offending line.
+ *
+ * The text is cut into chunks at line boundaries, the chunks are parsed on the thread
+ * pool, and their objects are then copied into the scene arrays in parallel, each
+ * chunk at the offset the counts of the chunks before it give.
+ */
+bool parse_text_scene(const char *data, size_t size, input_data_t *input_data, string *error) {
+  int chunks = size < (1 << 20) || thread_pool().size() == 1 ? 1 : thread_pool().size() * 4;
+  vector<size_t> bounds(chunks + 1, size);
+  bounds[0] = 0;
+  for(int c = 1; c < chunks; c++) {
+    size_t at = max(bounds[c - 1], (size_t) ((double) size * c / chunks));
+    const char *newline = at < size ? (const char*) memchr(data + at, '\n', size - at) : NULL;
+    bounds[c] = newline == NULL ? size : newline - data + 1;
+  }
+  vector<text_chunk_t> parsed(chunks);
+  parallel_chunks(0, chunks, chunks, [&](int c, int, int) {
+    parse_text_chunk(data + bounds[c], data + bounds[c + 1], &parsed[c]);
+  });
+
+  int line_offset = 0;
+  size_t planes = 0;
+  vector<size_t> sphere_offsets(chunks + 1, 0), light_offsets(chunks + 1, 0);
+  for(int c = 0; c < chunks; c++) {
+    if(parsed[c].error_line != -1) {
+      *error = "line " + to_string(line_offset + parsed[c].error_line) + ": cannot read \"" + parsed[c].error_text + "\"";
+      return false;
+    }
+    line_offset += parsed[c].lines;
+    planes += parsed[c].planes.size();
+    sphere_offsets[c + 1] = sphere_offsets[c] + parsed[c].spheres.size();
+    light_offsets[c + 1] = light_offsets[c] + parsed[c].light_positions.size();
+  }
+  if(planes > 1) {
+    *error = to_string(planes) + " planes given, only a single ground plane is supported";
+    return false;
+  }
+
+  input_data->ground_plane = default_ground_plane();
+  if(chunks == 1) {
+    input_data->spheres = move(parsed[0].spheres);
+    input_data->light_positions = move(parsed[0].light_positions);
+    if(planes == 1) input_data->ground_plane = parsed[0].planes[0];
+    return true;
+  }
+  input_data->spheres.resize(sphere_offsets[chunks]);
+  input_data->light_positions.resize(light_offsets[chunks]);
+  parallel_chunks(0, chunks, chunks, [&](int c, int, int) {
+    copy(parsed[c].spheres.begin(), parsed[c].spheres.end(), input_data->spheres.begin() + sphere_offsets[c]);
+    copy(parsed[c].light_positions.begin(), parsed[c].light_positions.end(), input_data->light_positions.begin() + light_offsets[c]);
+    if(!parsed[c].planes.empty()) input_data->ground_plane = parsed[c].planes[0];
+  });
+  return true;
+}
+
+/**
+ * Loads a text scene file, mapped into memory in one go and parsed by
+ * `parse_text_scene`.
+ */
+bool load_text_scene(const string &path, input_data_t *input_data, string *error) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if(fd < 0) {
+    *error = "cannot open " + path;
+    return false;
+  }
+  struct stat info;
+  if(fstat(fd, &info) != 0) {
+    close(fd);
+    *error = "cannot read " + path;
+    return false;
+  }
+  size_t size = info.st_size;
+  if(size == 0) {
+    close(fd);
+    return parse_text_scene("", 0, input_data, error);
+  }
+  void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(mapping == MAP_FAILED) {
+    *error = "cannot map " + path;
+    return false;
+  }
+  madvise(mapping, size, MADV_SEQUENTIAL);
+  bool loaded = parse_text_scene((const char*) mapping, size, input_data, error);
+  munmap(mapping, size);
+  if(!loaded) *error = path + ", " + *error;
+  return loaded;
+}
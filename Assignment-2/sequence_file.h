@@ -0,0 +1,133 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <fstream>
+#include "main.h"
+#include "scene.h"
+#include "camera.h"
+#include "instance.h"
+#include "scene_file.h"
+
+/**
+ * Frames of a sequence rendered together in one job. Every one of them holds a
+ * G-buffer and a plane until the batch is written out, so this bounds the memory a
+ * sequence takes however long it is, while giving the thread pool the tiles of several
+ * frames at once.
+ */
+#define SEQUENCE_BATCH_FRAMES 8
+
+/**
+ * A new model matrix for an instance of the scene, numbered from 0 like
+ * `input_data.instances`.
+ */
+struct instance_move_t {
+  int instance;
+  transform_t to_world;
+};
+
+/**
+ * One frame of a sequence: its camera and lights, and the instances that moved since
+ * the frame before it. Everything else is the scene's, shared by all frames.
+ */
+struct sequence_frame_t {
+  camera_t camera;
+  vector<position_t> light_positions;
+  vector<instance_move_t> moves;
+};
+
+/**
+ * Loads a sequence file, which animates the scene frame by frame:
+ *
+ *   frame                                        starts the next frame
+ *   camera ex ey ez tx ty tz [ux uy uz]          places its camera, like in a view file
+ *   light n x y z                                moves light n to (x, y, z)
+ *   instance n m00 m01 m02 m03 m10 ... m23       gives instance n a new model matrix
+ *
+ * Lights and instances are numbered from 1 in the order the scene has them. Every
+ * frame starts as the frame before it left off, the first one as the scene was loaded
+ * and seen from `default_camera`, so a frame only lists what changes. Blank lines and
+ * lines starting with '#' are skipped.
+ */
+bool load_sequence_file(const string &path, const input_data_t &input_data, vector<sequence_frame_t> *frames, string *error) {
+  ifstream file(path);
+  if(!file) {
+    *error = "cannot open " + path;
+    return false;
+  }
+  string line;
+  for(int number = 1; getline(file, line); number++) {
+    const char *p = line.data(), *end = line.data() + line.size();
+    while(p < end && is_blank(*p)) p++;
+    const char *kind = p;
+    while(p < end && !is_blank(*p)) p++;
+    string_view keyword(kind, p - kind);
+    string where = path + ", line " + to_string(number) + ": ";
+
+    if(keyword.empty() || keyword[0] == '#') continue;
+    if(keyword == "frame") {
+      while(p < end && is_blank(*p)) p++;
+      if(p != end) {
+        *error = where + "cannot read \"" + line + "\"";
+        return false;
+      }
+      frames->push_back(frames->empty()
+        ? sequence_frame_t { default_camera(), input_data.light_positions }
+        : sequence_frame_t { frames->back().camera, frames->back().light_positions });
+      continue;
+    }
+    if(frames->empty()) {
+      *error = where + "\"" + string(keyword) + "\" comes before the first frame";
+      return false;
+    }
+    sequence_frame_t &frame = frames->back();
+    int fields_wanted = keyword == "camera" ? 9 : keyword == "light" ? 3 : keyword == "instance" ? 12 : 0;
+    int index = 0;
+    bool parsed = fields_wanted > 0 && (keyword == "camera" || read_field(&p, end, &index));
+    double fields[12] = { 0, 0, 0, 0, 0, 0, 0, 1, 0 };
+    int count = 0;
+    while(parsed && count < fields_wanted) {
+      while(p < end && is_blank(*p)) p++;
+      if(p == end) break;
+      parsed = read_field(&p, end, &fields[count++]);
+    }
+    while(p < end && is_blank(*p)) p++;
+    bool complete = count == fields_wanted || (keyword == "camera" && count == 6);
+    if(!parsed || p != end || !complete) {
+      *error = where + "cannot read \"" + line + "\"";
+      return false;
+    }
+    if(keyword == "camera") {
+      position_t eye = position_t { fields[0], fields[1], fields[2] };
+      position_t target = position_t { fields[3], fields[4], fields[5] };
+      if(!look_at(eye, target, position_t { fields[6], fields[7], fields[8] }, &frame.camera)) {
+        *error = where + "the camera looks at its own eye or along its up vector";
+        return false;
+      }
+    } else if(keyword == "light") {
+      if(index < 1 || index > (int) frame.light_positions.size()) {
+        *error = where + "there is no light " + to_string(index);
+        return false;
+      }
+      frame.light_positions[index - 1] = position_t { fields[0], fields[1], fields[2] };
+    } else {
+      transform_t to_world, to_object;
+      for(int i = 0; i < 12; i++) to_world.m[i / 4][i % 4] = fields[i];
+      if(index < 1 || index > (int) input_data.instances.size()) {
+        *error = where + "there is no instance " + to_string(index);
+        return false;
+      }
+      if(!invert_transform(to_world, &to_object)) {
+        *error = where + "the transform is singular";
+        return false;
+      }
+      frame.moves.push_back(instance_move_t { index - 1, to_world });
+    }
+  }
+  if(frames->empty()) {
+    *error = path + " has no frames";
+    return false;
+  }
+  return true;
+}
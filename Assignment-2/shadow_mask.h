@@ -0,0 +1,348 @@
+#pragma once
+
+#include <vector>
+#include <math.h>
+#include "main.h"
+#include "scene.h"
+#include "camera.h"
+
+/**
+ * Resolution of the shadow masks, in cells per side. Matching the image resolution
+ * keeps a cell roughly the size of the plane footprint of one pixel.
+ */
+#define SHADOW_MASK_RESOLUTION (PLANE_WIDTH * RESOLUTION_COEFF)
+
+/**
+ * Sphere cell tests a mask may take per cell before it is given up. A test costs a
+ * fraction of the shadow ray it can save, and a mask saves at most one ray per pixel,
+ * so a mask whose spheres reach over many more cells than it has costs more than
+ * tracing every shadow ray.
+ */
+#define SHADOW_MASK_TESTS_PER_CELL 8
+
+/**
+ * What a mask cell knows about the visibility of the light from every point in it.
+ * MASK_EDGE cells are crossed by a shadow boundary (or are otherwise ambiguous) and
+ * still need a real shadow ray.
+ */
+enum mask_state {
+  MASK_LIT,
+  MASK_SHADOWED,
+  MASK_EDGE
+};
+
+/**
+ * Occlusion mask of a single light over the visible part of the ground plane. Cells
+ * live in plane space: a point p on the plane maps to (u, v) = ((p - base) . u_axis,
+ * (p - base) . v_axis).
+ */
+struct shadow_mask_t {
+  bool valid;
+  position_t base;
+  position_t u_axis;
+  position_t v_axis;
+  double u_start;
+  double v_start;
+  double cell_size_u;
+  double cell_size_v;
+  int resolution;
+  vector<unsigned char> cells;
+
+  mask_state lookup(position_t point) const {
+    if(!this->valid) return MASK_EDGE;
+    position_t rel = point - this->base;
+    int i = (int) floor((dot(rel, this->u_axis) - this->u_start) / this->cell_size_u);
+    int j = (int) floor((dot(rel, this->v_axis) - this->v_start) / this->cell_size_v);
+    if(i < 0 || j < 0 || i >= this->resolution || j >= this->resolution) return MASK_EDGE;
+    return (mask_state) this->cells[i * this->resolution + j];
+  }
+};
+
+/**
+ * Picks two unit axes spanning the plane with the given normal.
+ */
+void plane_axes(position_t normal, position_t *u_axis, position_t *v_axis) {
+  position_t n = normalized(normal);
+  position_t helper = fabs(n.x) < 0.9 ? position_t { 1, 0, 0 } : position_t { 0, 1, 0 };
+  *u_axis = normalized(cross(helper, n));
+  *v_axis = cross(n, *u_axis);
+}
+
+/**
+ * Central projection of `point` from `light` onto the plane. Returns false if the
+ * point is not strictly between the light and the plane, in which case the projection
+ * does not bound the shadow.
+ */
+bool project_from_light(position_t light, position_t point, position_t plane_point, position_t normal, position_t *projected) {
+  double light_height = dot(light - plane_point, normal);
+  double point_height = dot(point - plane_point, normal);
+  if(point_height <= 0 || point_height >= light_height) return false;
+  double t = light_height / (light_height - point_height);
+  *projected = light + (point - light) * t;
+  return true;
+}
+
+/**
+ * Classifies a square cell of half diagonal `half_diagonal` around `center` against the
+ * shadow cone a sphere casts from a point light. The cone has its apex at the light,
+ * its axis towards the sphere center and half-angle asin(r / d); on the plane it is the
+ * conic section bounding the shadow. The cell's own angular radius as seen from the
+ * light is used as a margin, so MASK_LIT and MASK_SHADOWED hold for every point of it.
+ */
+mask_state classify_cell(position_t light, sphere_t sphere, position_t center, double half_diagonal) {
+  position_t to_sphere = sphere.center - light;
+  double sphere_distance = to_sphere.length();
+  if(sphere_distance <= sphere.radius) return MASK_EDGE;
+  position_t to_cell = center - light;
+  double cell_distance = to_cell.length();
+  if(cell_distance <= half_diagonal) return MASK_EDGE;
+
+  double half_angle = asin(sphere.radius / sphere_distance);
+  double cell_angle = asin(half_diagonal / cell_distance);
+  double angle = acos(max(-1.0, min(1.0, dot(to_cell, to_sphere) / (cell_distance * sphere_distance))));
+
+  if(angle - cell_angle > half_angle) return MASK_LIT;
+  if(cell_distance + half_diagonal < sphere_distance - sphere.radius) return MASK_LIT;
+  if(angle + cell_angle < half_angle && cell_distance - half_diagonal > sphere_distance + sphere.radius + sqrt(CLOSENESS_TOLERANCE)) {
+    return MASK_SHADOWED;
+  }
+  return MASK_EDGE;
+}
+
+/**
+ * Inclusive range of mask cells, i along u and j along v.
+ */
+struct mask_rect_t {
+  int i_start;
+  int i_end;
+  int j_start;
+  int j_end;
+};
+
+/**
+ * Normal of the ground plane on the side of the light.
+ */
+position_t light_side_normal(plane_t ground_plane, position_t light) {
+  position_t normal = normalized(ground_plane.normal_vector.approximate());
+  if(dot(light - ground_plane.point, normal) < 0) normal = normal * -1;
+  return normal;
+}
+
+/**
+ * Finds the cells of the mask the shadow of the sphere may fall on. Only the part of
+ * the sphere between the plane and the height of the light casts a shadow on the
+ * plane, so the box around the sphere is taken in plane coordinates and clipped to
+ * that slab; returns false if nothing of it is left. Points just below the height of
+ * the light project arbitrarily far away, so the box is clipped further down to where
+ * its projection leaves the mask, which the horizontal distance of the sphere from the
+ * light tells. Only a sphere right above or below the light keeps the whole mask.
+ */
+bool sphere_shadow_cells(const shadow_mask_t &mask, position_t light, position_t normal, sphere_t sphere, mask_rect_t *rect) {
+  int res = mask.resolution;
+  position_t rel_light = light - mask.base, rel_center = sphere.center - mask.base;
+  double light_u = dot(rel_light, mask.u_axis), light_v = dot(rel_light, mask.v_axis), light_height = dot(rel_light, normal);
+  double center_u = dot(rel_center, mask.u_axis), center_v = dot(rel_center, mask.v_axis), center_height = dot(rel_center, normal);
+  double low = max(0.0, center_height - sphere.radius), high = min(light_height, center_height + sphere.radius);
+  if(low >= high) return false;
+
+  double u_end = mask.u_start + res * mask.cell_size_u, v_end = mask.v_start + res * mask.cell_size_v;
+  double du = max(0.0, fabs(light_u - center_u) - sphere.radius), dv = max(0.0, fabs(light_v - center_v) - sphere.radius);
+  double nearest = sqrt(du * du + dv * dv);
+  double reach = 0;
+  for(double u : { mask.u_start, u_end }) {
+    for(double v : { mask.v_start, v_end }) reach = max(reach, sqrt((u - light_u) * (u - light_u) + (v - light_v) * (v - light_v)));
+  }
+  if(high >= light_height) {
+    if(nearest == 0) {
+      *rect = mask_rect_t { 0, res - 1, 0, res - 1 };
+      return true;
+    }
+    /* A point at horizontal distance d and height h lands d * L / (L - h) from the light */
+    high = min(high, light_height * (1 - nearest / reach));
+    if(low >= high) return false;
+  }
+
+  double u_min = INFINITY, u_max = -INFINITY, v_min = INFINITY, v_max = -INFINITY;
+  for(int corner = 0; corner < 8; corner++) {
+    double u = center_u + ((corner & 1) ? sphere.radius : -sphere.radius);
+    double v = center_v + ((corner & 2) ? sphere.radius : -sphere.radius);
+    double scale = light_height / (light_height - ((corner & 4) ? high : low));
+    u_min = min(u_min, light_u + (u - light_u) * scale);
+    u_max = max(u_max, light_u + (u - light_u) * scale);
+    v_min = min(v_min, light_v + (v - light_v) * scale);
+    v_max = max(v_max, light_v + (v - light_v) * scale);
+  }
+  *rect = mask_rect_t {
+    max(0, (int) floor((u_min - mask.u_start) / mask.cell_size_u) - 1),
+    min(res - 1, (int) floor((u_max - mask.u_start) / mask.cell_size_u) + 1),
+    max(0, (int) floor((v_min - mask.v_start) / mask.cell_size_v) - 1),
+    min(res - 1, (int) floor((v_max - mask.v_start) / mask.cell_size_v) + 1)
+  };
+  return rect->i_start <= rect->i_end && rect->j_start <= rect->j_end;
+}
+
+/**
+ * Classifies the cells of `rect` against the shadow of one sphere, keeping what other
+ * spheres already made of them.
+ */
+void rasterize_sphere_shadow(shadow_mask_t *mask, position_t light, sphere_t sphere, mask_rect_t rect) {
+  int res = mask->resolution;
+  double half_diagonal = sqrt(mask->cell_size_u * mask->cell_size_u + mask->cell_size_v * mask->cell_size_v) / 2;
+  for(int i = rect.i_start; i <= rect.i_end; i++) {
+    for(int j = rect.j_start; j <= rect.j_end; j++) {
+      unsigned char &cell = mask->cells[i * res + j];
+      if(cell == MASK_SHADOWED) continue;
+      position_t center = mask->base
+        + mask->u_axis * (mask->u_start + (i + 0.5) * mask->cell_size_u)
+        + mask->v_axis * (mask->v_start + (j + 0.5) * mask->cell_size_v);
+      mask_state state = classify_cell(light, sphere, center, half_diagonal);
+      if(state == MASK_SHADOWED || (state == MASK_EDGE && cell == MASK_LIT)) cell = state;
+    }
+  }
+}
+
+/**
+ * Rasterizes the shadows of all spheres from one light into a mask covering the
+ * (u, v) rectangle [u_start, u_end] x [v_start, v_end] of the plane. Each sphere only
+ * touches the cells `sphere_shadow_cells` gives it; when they add up to more than
+ * SHADOW_MASK_TESTS_PER_CELL tests per cell, the mask is left invalid instead.
+ */
+shadow_mask_t rasterize_shadow_mask(position_t light, const vector<sphere_t> &spheres, plane_t ground_plane,
+                                   position_t u_axis, position_t v_axis,
+                                   double u_start, double u_end, double v_start, double v_end) {
+  int res = SHADOW_MASK_RESOLUTION;
+  shadow_mask_t mask = shadow_mask_t {
+    true, ground_plane.point, u_axis, v_axis, u_start, v_start,
+    (u_end - u_start) / res, (v_end - v_start) / res, res,
+    vector<unsigned char>(res * res, MASK_LIT)
+  };
+  position_t normal = light_side_normal(ground_plane, light);
+  vector<int> casting;
+  vector<mask_rect_t> rects;
+  long long tests = 0;
+  for(int s = 0; s < (int) spheres.size(); s++) {
+    mask_rect_t rect;
+    if(!sphere_shadow_cells(mask, light, normal, spheres[s], &rect)) continue;
+    casting.push_back(s);
+    rects.push_back(rect);
+    tests += (long long) (rect.i_end - rect.i_start + 1) * (rect.j_end - rect.j_start + 1);
+  }
+  if(tests > (long long) SHADOW_MASK_TESTS_PER_CELL * res * res) return shadow_mask_t { false };
+  for(int k = 0; k < (int) casting.size(); k++) rasterize_sphere_shadow(&mask, light, spheres[casting[k]], rects[k]);
+  return mask;
+}
+
+/**
+ * Marks the cells a box may shadow from the light as MASK_EDGE, leaving cells already
+ * known to be shadowed alone. Used for instances, whose shadows are not classified cell
+ * by cell but left to shadow rays. A box whose shadow cannot be bounded on the plane
+ * invalidates the whole mask.
+ */
+void mark_box_shadow(shadow_mask_t *mask, position_t light, aabb_t box, plane_t ground_plane) {
+  if(!mask->valid || box.low.x > box.high.x) return;
+  position_t normal = light_side_normal(ground_plane, light);
+  double light_height = dot(light - ground_plane.point, normal);
+  double u_min = INFINITY, u_max = -INFINITY, v_min = INFINITY, v_max = -INFINITY;
+  int projected_count = 0, above_light = 0;
+  for(int corner = 0; corner < 8; corner++) {
+    position_t corner_point = position_t {
+      (corner & 1) ? box.high.x : box.low.x,
+      (corner & 2) ? box.high.y : box.low.y,
+      (corner & 4) ? box.high.z : box.low.z
+    };
+    position_t projected;
+    if(!project_from_light(light, corner_point, ground_plane.point, normal, &projected)) {
+      if(dot(corner_point - ground_plane.point, normal) >= light_height) above_light++;
+      continue;
+    }
+    projected_count++;
+    position_t rel = projected - mask->base;
+    u_min = min(u_min, dot(rel, mask->u_axis));
+    u_max = max(u_max, dot(rel, mask->u_axis));
+    v_min = min(v_min, dot(rel, mask->v_axis));
+    v_max = max(v_max, dot(rel, mask->v_axis));
+  }
+  if(above_light == 8) return;
+  if(projected_count < 8) {
+    mask->valid = false;
+    return;
+  }
+  int res = mask->resolution;
+  int i_start = max(0, (int) floor((u_min - mask->u_start) / mask->cell_size_u) - 1);
+  int i_end = min(res - 1, (int) floor((u_max - mask->u_start) / mask->cell_size_u) + 1);
+  int j_start = max(0, (int) floor((v_min - mask->v_start) / mask->cell_size_v) - 1);
+  int j_end = min(res - 1, (int) floor((v_max - mask->v_start) / mask->cell_size_v) + 1);
+  for(int i = i_start; i <= i_end; i++) {
+    for(int j = j_start; j <= j_end; j++) {
+      unsigned char &cell = mask->cells[i * res + j];
+      if(cell == MASK_LIT) cell = MASK_EDGE;
+    }
+  }
+}
+
+/**
+ * Pre-pass building the shadow mask of one light over the part of the ground plane
+ * seen by any of the cameras, so that views of the same scene share it. If a corner ray
+ * of an image misses the ground plane the visible region is unbounded, and the mask is
+ * left invalid so every lookup falls back to tracing. So it is for area lights, whose
+ * shadows the cones of `classify_cell` do not bound.
+ */
+shadow_mask_t build_shadow_mask(const input_data_t &input_data, position_t light, const vector<camera_t> &cameras) {
+  if(input_data.light_radius > 0) return shadow_mask_t { false };
+  plane_t ground_plane = input_data.ground_plane;
+  position_t normal = normalized(ground_plane.normal_vector.approximate());
+  position_t u_axis, v_axis;
+  plane_axes(normal, &u_axis, &v_axis);
+
+  double u_min = INFINITY, u_max = -INFINITY, v_min = INFINITY, v_max = -INFINITY;
+  double corners[4][2] = {
+    { PLANE_START_X, PLANE_START_Y }, { PLANE_END_X, PLANE_START_Y },
+    { PLANE_START_X, PLANE_END_Y }, { PLANE_END_X, PLANE_END_Y }
+  };
+  for(camera_t camera : cameras) {
+    for(int c = 0; c < 4; c++) {
+      position_t direction = camera.direction(corners[c][0], corners[c][1]).approximate();
+      double denominator = dot(direction, normal);
+      double t = denominator == 0 ? -1 : dot(ground_plane.point - camera.eye, normal) / denominator;
+      if(t <= 0) return shadow_mask_t { false };
+      position_t rel = camera.eye + direction * t - ground_plane.point;
+      u_min = min(u_min, dot(rel, u_axis));
+      u_max = max(u_max, dot(rel, u_axis));
+      v_min = min(v_min, dot(rel, v_axis));
+      v_max = max(v_max, dot(rel, v_axis));
+    }
+  }
+  shadow_mask_t mask = rasterize_shadow_mask(light, input_data.spheres, ground_plane, u_axis, v_axis, u_min, u_max, v_min, v_max);
+  for(const instance_t & instance : input_data.instances) mark_box_shadow(&mask, light, instance.bounds, ground_plane);
+  return mask;
+}
+
+/**
+ * Brings the mask of a light in line with an edit of one sphere, which `spheres`
+ * already holds in its new place. Only the cells under the old and the new shadow of
+ * the sphere can change: they are cleared and classified anew against every sphere
+ * whose shadow reaches them, and instance boxes are marked over them again. An invalid
+ * mask stays invalid.
+ */
+void update_shadow_mask(shadow_mask_t *mask, const input_data_t &input_data, position_t light, sphere_t old_sphere, sphere_t new_sphere) {
+  if(!mask->valid) return;
+  int res = mask->resolution;
+  position_t normal = light_side_normal(input_data.ground_plane, light);
+  for(sphere_t edited : { old_sphere, new_sphere }) {
+    mask_rect_t dirty;
+    if(!sphere_shadow_cells(*mask, light, normal, edited, &dirty)) continue;
+    for(int i = dirty.i_start; i <= dirty.i_end; i++) {
+      fill(mask->cells.begin() + i * res + dirty.j_start, mask->cells.begin() + i * res + dirty.j_end + 1, MASK_LIT);
+    }
+    for(const sphere_t & sphere : input_data.spheres) {
+      mask_rect_t rect;
+      if(!sphere_shadow_cells(*mask, light, normal, sphere, &rect)) continue;
+      rect = mask_rect_t {
+        max(rect.i_start, dirty.i_start), min(rect.i_end, dirty.i_end),
+        max(rect.j_start, dirty.j_start), min(rect.j_end, dirty.j_end)
+      };
+      if(rect.i_start <= rect.i_end && rect.j_start <= rect.j_end) rasterize_sphere_shadow(mask, light, sphere, rect);
+    }
+  }
+  for(const instance_t & instance : input_data.instances) mark_box_shadow(mask, light, instance.bounds, input_data.ground_plane);
+}
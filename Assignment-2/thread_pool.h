@@ -0,0 +1,124 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+
+using namespace std;
+
+/**
+ * Tasks submitted together so that their submitter can wait for all of them. Tasks may
+ * submit more tasks to the same group.
+ */
+struct task_group_t {
+  atomic<int> pending;
+  task_group_t() : pending(0) {}
+};
+
+/**
+ * Fixed set of worker threads fed from a single queue. A thread waiting on a group runs
+ * queued tasks itself in the meantime, so tasks can wait on groups of their own without
+ * starving the pool.
+ */
+struct thread_pool_t {
+  vector<thread> workers;
+  deque<pair<task_group_t*, function<void()>>> tasks;
+  mutex lock;
+  condition_variable changed;
+  bool stopping;
+
+  thread_pool_t(int threads) : stopping(false) {
+    for(int i = 0; i < max(1, threads); i++) {
+      this->workers.push_back(thread([this]() {
+        unique_lock<mutex> guard(this->lock);
+        while(true) {
+          this->changed.wait(guard, [this]() { return this->stopping || !this->tasks.empty(); });
+          if(this->tasks.empty()) return;
+          this->run_front(&guard);
+        }
+      }));
+    }
+  }
+
+  ~thread_pool_t() {
+    {
+      lock_guard<mutex> guard(this->lock);
+      this->stopping = true;
+    }
+    this->changed.notify_all();
+    for(thread & worker : this->workers) worker.join();
+  }
+
+  int size() const {
+    return this->workers.size();
+  }
+
+  void submit(task_group_t *group, function<void()> task) {
+    group->pending++;
+    {
+      lock_guard<mutex> guard(this->lock);
+      this->tasks.push_back(make_pair(group, move(task)));
+    }
+    this->changed.notify_one();
+  }
+
+  /**
+   * Blocks until every task of the group has finished, running queued tasks meanwhile.
+   */
+  void wait(task_group_t *group) {
+    unique_lock<mutex> guard(this->lock);
+    while(group->pending > 0) {
+      if(!this->tasks.empty()) {
+        this->run_front(&guard);
+      } else {
+        this->changed.wait(guard, [this, group]() { return group->pending == 0 || !this->tasks.empty(); });
+      }
+    }
+  }
+
+  /**
+   * Pops the first task and runs it with the lock released. Expects the lock held and
+   * the queue non-empty.
+   */
+  void run_front(unique_lock<mutex> *guard) {
+    pair<task_group_t*, function<void()>> task = move(this->tasks.front());
+    this->tasks.pop_front();
+    guard->unlock();
+    task.second();
+    guard->lock();
+    task.first->pending--;
+    this->changed.notify_all();
+  }
+};
+
+/**
+ * The pool shared by everything in the renderer, one worker per hardware thread.
+ */
+thread_pool_t &thread_pool() {
+  static thread_pool_t pool(thread::hardware_concurrency());
+  return pool;
+}
+
+/**
+ * Runs body(chunk, begin, end) over [first, last) split into `chunks` contiguous
+ * ranges on the pool, and waits for all of them. Chunks may be empty.
+ */
+template <typename action>
+void parallel_chunks(int first, int last, int chunks, action body) {
+  int count = last - first;
+  if(chunks <= 1) {
+    body(0, first, last);
+    return;
+  }
+  task_group_t group;
+  for(int c = 0; c < chunks; c++) {
+    int begin = first + (long long) count * c / chunks;
+    int end = first + (long long) count * (c + 1) / chunks;
+    thread_pool().submit(&group, [&body, c, begin, end]() { body(c, begin, end); });
+  }
+  thread_pool().wait(&group);
+}
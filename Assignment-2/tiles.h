@@ -0,0 +1,146 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include "main.h"
+#include "thread_pool.h"
+
+/**
+ * Side length of a tile in pixels.
+ */
+#define TILE_SIZE 32
+
+/**
+ * A rectangle of pixels, [x_start, x_end) x [y_start, y_end). Rendering passes work
+ * tile by tile so that parts of the frame can be redone on their own.
+ */
+struct tile_t {
+  int x_start;
+  int y_start;
+  int x_end;
+  int y_end;
+};
+
+/**
+ * Splits a width x height frame into tiles, column by column like the plane is indexed.
+ */
+vector<tile_t> frame_tiles(int width, int height) {
+  vector<tile_t> tiles;
+  for(int x = 0; x < width; x += TILE_SIZE) {
+    for(int y = 0; y < height; y += TILE_SIZE) {
+      tiles.push_back(tile_t { x, y, min(x + TILE_SIZE, width), min(y + TILE_SIZE, height) });
+    }
+  }
+  return tiles;
+}
+
+/**
+ * Orders the render passes can go through the tiles in. Consecutive tiles of the order
+ * go to the same thread and into the same ray batches, so orders that keep them next
+ * to each other let the batches share more of the scene.
+ *
+ *   columns     column by column, the order of `frame_tiles`
+ *   scanline    row by row
+ *   morton      along the Z-order curve over the tile grid
+ *   hilbert     along the Hilbert curve over the tile grid, which unlike the Z-order
+ *               curve never jumps between tiles that are not neighbors
+ *   center      outwards from the middle of the frame in square rings, each walked
+ *               around
+ */
+enum tile_order_t {
+  TILE_ORDER_COLUMNS,
+  TILE_ORDER_SCANLINE,
+  TILE_ORDER_MORTON,
+  TILE_ORDER_HILBERT,
+  TILE_ORDER_CENTER
+};
+
+const char *tile_order_names[] = { "columns", "scanline", "morton", "hilbert", "center" };
+
+/**
+ * Interleaves the bits of x and y, y taking the odd bits.
+ */
+long long interleave_bits(int x, int y) {
+  long long code = 0;
+  for(int bit = 0; bit < 16; bit++) {
+    code |= (long long) ((x >> bit) & 1) << (2 * bit) | (long long) ((y >> bit) & 1) << (2 * bit + 1);
+  }
+  return code;
+}
+
+/**
+ * Distance of the cell (x, y) along the Hilbert curve through a side x side grid, side
+ * a power of two.
+ */
+long long hilbert_index(int side, int x, int y) {
+  long long index = 0;
+  for(int half = side / 2; half > 0; half /= 2) {
+    int rx = (x & half) > 0, ry = (y & half) > 0;
+    index += (long long) half * half * ((3 * rx) ^ ry);
+    if(ry == 0) {
+      if(rx == 1) {
+        x = side - 1 - x;
+        y = side - 1 - y;
+      }
+      swap(x, y);
+    }
+  }
+  return index;
+}
+
+/**
+ * Puts the tiles into the given order. Tiles are placed by their corner on the grid of
+ * TILE_SIZE cells, so any subset of the frame's tiles can be ordered.
+ */
+vector<tile_t> order_tiles(vector<tile_t> tiles, tile_order_t order) {
+  if(order == TILE_ORDER_COLUMNS || tiles.empty()) return tiles;
+  int columns = 0, rows = 0;
+  for(tile_t tile : tiles) {
+    columns = max(columns, tile.x_start / TILE_SIZE + 1);
+    rows = max(rows, tile.y_start / TILE_SIZE + 1);
+  }
+  int side = 1;
+  while(side < max(columns, rows)) side *= 2;
+  vector<pair<long long, int>> keys(tiles.size());
+  for(int t = 0; t < (int) tiles.size(); t++) {
+    int x = tiles[t].x_start / TILE_SIZE, y = tiles[t].y_start / TILE_SIZE;
+    long long key = 0;
+    if(order == TILE_ORDER_SCANLINE) {
+      key = (long long) y * columns + x;
+    } else if(order == TILE_ORDER_MORTON) {
+      key = interleave_bits(x, y);
+    } else if(order == TILE_ORDER_HILBERT) {
+      key = hilbert_index(side, x, y);
+    } else {
+      /* Square rings around the middle, each walked around by angle */
+      double dx = x + 0.5 - columns / 2.0, dy = y + 0.5 - rows / 2.0;
+      long long ring = (long long) max(fabs(dx), fabs(dy));
+      key = ring * 4096 + (long long) ((atan2(dy, dx) + M_PI) / (2 * M_PI) * 4095);
+    }
+    keys[t] = make_pair(key, t);
+  }
+  sort(keys.begin(), keys.end());
+  vector<tile_t> ordered;
+  for(pair<long long, int> key : keys) ordered.push_back(tiles[key.second]);
+  return ordered;
+}
+
+/**
+ * Number of runs `parallel_tiles` splits the tiles into: a few per thread so a slow run
+ * does not hold up the rest, or a single one without other threads to share with.
+ */
+int tile_runs() {
+  return thread_pool().size() == 1 ? 1 : thread_pool().size() * 4;
+}
+
+/**
+ * Runs body(run, tiles) on the thread pool for every run of consecutive tiles, in the
+ * order given, and waits for all of them.
+ */
+template <typename action>
+void parallel_tiles(const vector<tile_t> &tiles, action body) {
+  parallel_chunks(0, tiles.size(), tile_runs(), [&](int run, int begin, int end) {
+    body(run, vector<tile_t>(tiles.begin() + begin, tiles.begin() + end));
+  });
+}
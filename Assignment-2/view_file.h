@@ -0,0 +1,64 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <fstream>
+#include "main.h"
+#include "camera.h"
+#include "scene_file.h"
+
+/**
+ * Loads a view file, one camera per line:
+ *
+ *   camera ex ey ez tx ty tz [ux uy uz]
+ *
+ * A camera at (ex, ey, ez) looking at (tx, ty, tz), turned so that (ux, uy, uz), or y
+ * when it is left out, points up in its image; see `look_at`. The views are numbered
+ * from 1 in the order they are given. Blank lines and lines starting with '#' are
+ * skipped.
+ */
+bool load_view_file(const string &path, vector<camera_t> *cameras, string *error) {
+  ifstream file(path);
+  if(!file) {
+    *error = "cannot open " + path;
+    return false;
+  }
+  string line;
+  for(int number = 1; getline(file, line); number++) {
+    const char *p = line.data(), *end = line.data() + line.size();
+    while(p < end && is_blank(*p)) p++;
+    const char *kind = p;
+    while(p < end && !is_blank(*p)) p++;
+    string_view keyword(kind, p - kind);
+    string where = path + ", line " + to_string(number) + ": ";
+
+    if(keyword.empty() || keyword[0] == '#') continue;
+    double fields[9] = { 0, 0, 0, 0, 0, 0, 0, 1, 0 };
+    int count = 0;
+    bool parsed = keyword == "camera";
+    while(parsed && count < 9) {
+      while(p < end && is_blank(*p)) p++;
+      if(p == end) break;
+      parsed = read_field(&p, end, &fields[count++]);
+    }
+    while(p < end && is_blank(*p)) p++;
+    if(!parsed || p != end || (count != 6 && count != 9)) {
+      *error = where + "cannot read \"" + line + "\"";
+      return false;
+    }
+    camera_t camera;
+    position_t eye = position_t { fields[0], fields[1], fields[2] };
+    position_t target = position_t { fields[3], fields[4], fields[5] };
+    if(!look_at(eye, target, position_t { fields[6], fields[7], fields[8] }, &camera)) {
+      *error = where + "the camera looks at its own eye or along its up vector";
+      return false;
+    }
+    cameras->push_back(camera);
+  }
+  if(cameras->empty()) {
+    *error = path + " has no views";
+    return false;
+  }
+  return true;
+}
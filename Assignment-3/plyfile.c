@@ -2498,7 +2498,7 @@ lnum  - line number from which memory was requested
 fname - file name from which memory was requested
 ******************************************************************************/
 
-static char *my_alloc(int size, int lnum, char *fname)
+char *my_alloc(int size, int lnum, char *fname)
 {
 	char *ptr;
 